@@ -0,0 +1,379 @@
+/*********************************************************************
+ * RailuinoSeeed
+ * Adopted from: Railuino - Hacking your Märklin
+ *
+ * Copyright (C) 2012 Joerg Pleumann
+ * Copyright (C) 2022 Wolfgang Hammer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * LICENSE file for more details.
+ */
+
+#ifndef RailuinoContainers__h
+#define RailuinoContainers__h
+
+#include <Arduino.h>
+
+// ===================================================================
+// === Fixed-capacity containers =====================================
+// ===================================================================
+
+/*
+ * The containers below never use the heap, which quickly fragments
+ * on an Arduino. Their capacity is a template parameter, so the same
+ * code can use tiny sizes on an Uno and larger ones elsewhere.
+ */
+
+/**
+ * A fixed-size pool of N records of type T, handing them out from a
+ * free list over a static array. Keeps track of the highest number
+ * of records in use at the same time and of failed allocations.
+ */
+template <class T, byte N>
+class TrackPool
+{
+public:
+  TrackPool()
+  {
+    for (byte i = 0; i < N; i++)
+    {
+      mNext[i] = i + 1;
+    }
+  }
+
+  /**
+   * Returns an unused record, or nullptr if all are in use.
+   */
+  T *allocate()
+  {
+    if (mFree == N)
+    {
+      mExhausted++;
+      return nullptr;
+    }
+
+    byte index = mFree;
+    mFree = mNext[index];
+
+    if (++mUsed > mHighWater)
+    {
+      mHighWater = mUsed;
+    }
+
+    return &mItems[index];
+  }
+
+  /**
+   * Returns a record obtained from allocate() to the pool.
+   */
+  void release(T *item)
+  {
+    byte index = item - mItems;
+    mNext[index] = mFree;
+    mFree = index;
+    mUsed--;
+  }
+
+  byte used() const { return mUsed; }
+  byte highWater() const { return mHighWater; }
+  word exhausted() const { return mExhausted; }
+
+private:
+  T mItems[N] = {};
+  byte mNext[N];
+  byte mFree = 0;
+  byte mUsed = 0;
+  byte mHighWater = 0;
+  word mExhausted = 0;
+};
+
+/**
+ * A ring buffer (first in, first out) of up to N elements of type T.
+ */
+template <class T, byte N>
+class TrackRing
+{
+public:
+  /**
+   * Appends the given element, returning false if the ring is full.
+   */
+  boolean push(const T &item)
+  {
+    if (mCount == N)
+    {
+      return false;
+    }
+
+    mItems[(mHead + mCount++) % N] = item;
+    return true;
+  }
+
+  /**
+   * Appends the given element, dropping the oldest one if the ring
+   * is full.
+   */
+  void overwrite(const T &item)
+  {
+    if (mCount == N)
+    {
+      mHead = (mHead + 1) % N;
+      mCount--;
+    }
+
+    push(item);
+  }
+
+  /**
+   * Removes the oldest element into 'item', returning false if the
+   * ring is empty.
+   */
+  boolean pop(T &item)
+  {
+    if (mCount == 0)
+    {
+      return false;
+    }
+
+    item = mItems[mHead];
+    mHead = (mHead + 1) % N;
+    mCount--;
+    return true;
+  }
+
+  /**
+   * Returns the oldest element without removing it, or nullptr if
+   * the ring is empty.
+   */
+  T *peek()
+  {
+    return mCount != 0 ? &mItems[mHead] : nullptr;
+  }
+
+  void clear() { mHead = mCount = 0; }
+  byte size() const { return mCount; }
+  boolean empty() const { return mCount == 0; }
+  boolean full() const { return mCount == N; }
+
+private:
+  T mItems[N] = {};
+  byte mHead = 0;
+  byte mCount = 0;
+};
+
+/**
+ * A map of up to N entries from keys of type K, for instance
+ * locomotive addresses, to values of type V. Uses open addressing
+ * with linear probing over a single array, so lookups touch as
+ * little memory as possible. The key 'Empty' marks unused entries
+ * and can't be stored. N should exceed the number of entries
+ * actually used, ideally by a quarter or more.
+ */
+template <class K, class V, byte N, K Empty = 0>
+class TrackFlatMap
+{
+public:
+  TrackFlatMap()
+  {
+    clear();
+  }
+
+  /**
+   * Returns the value for the given key, or nullptr if there is none.
+   */
+  V *find(K key)
+  {
+    for (byte i = home(key), n = 0; n < N && mKeys[i] != Empty; i = (i + 1) % N, n++)
+    {
+      if (mKeys[i] == key)
+      {
+        return &mValues[i];
+      }
+    }
+
+    return nullptr;
+  }
+
+  /**
+   * Returns the value for the given key, adding a default-constructed
+   * one if there is none, or nullptr if the map is full.
+   */
+  V *insert(K key)
+  {
+    V *value = find(key);
+    if (value != nullptr || key == Empty || mCount == N)
+    {
+      return value;
+    }
+
+    byte i = home(key);
+    while (mKeys[i] != Empty)
+    {
+      i = (i + 1) % N;
+    }
+
+    mKeys[i] = key;
+    mValues[i] = V();
+    mCount++;
+    return &mValues[i];
+  }
+
+  /**
+   * Removes the given key, returning false if it wasn't there.
+   */
+  boolean erase(K key)
+  {
+    V *value = find(key);
+    if (value == nullptr)
+    {
+      return false;
+    }
+
+    // Shift following entries back so that no probe chain breaks
+    byte i = value - mValues;
+    byte j = i;
+    for (;;)
+    {
+      mKeys[i] = Empty;
+
+      for (;;)
+      {
+        j = (j + 1) % N;
+        if (mKeys[j] == Empty)
+        {
+          mCount--;
+          return true;
+        }
+
+        byte k = home(mKeys[j]);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+        {
+          continue;
+        }
+
+        mKeys[i] = mKeys[j];
+        mValues[i] = mValues[j];
+        i = j;
+        break;
+      }
+    }
+  }
+
+  void clear()
+  {
+    for (byte i = 0; i < N; i++)
+    {
+      mKeys[i] = Empty;
+    }
+    mCount = 0;
+  }
+
+  byte size() const { return mCount; }
+
+private:
+  static byte home(K key)
+  {
+    return (byte)(((uint32_t)key * 40503u) >> 8) % N;
+  }
+
+  K mKeys[N];
+  V mValues[N] = {};
+  byte mCount = 0;
+};
+
+/**
+ * A set of N bits, for instance the states of accessories or sensors,
+ * packed into N / 8 bytes.
+ */
+template <word N>
+class TrackBitset
+{
+public:
+  boolean get(word index) const
+  {
+    return (mBits[index >> 3] >> (index & 7)) & 1;
+  }
+
+  void set(word index, boolean value)
+  {
+    if (value)
+    {
+      mBits[index >> 3] |= 1 << (index & 7);
+    }
+    else
+    {
+      mBits[index >> 3] &= ~(1 << (index & 7));
+    }
+  }
+
+  void clear()
+  {
+    memset(mBits, 0, sizeof(mBits));
+  }
+
+  /**
+   * Returns the number of bits set.
+   */
+  word count() const
+  {
+    word result = 0;
+    for (word i = 0; i < sizeof(mBits); i++)
+    {
+      for (byte bits = mBits[i]; bits != 0; bits &= bits - 1)
+      {
+        result++;
+      }
+    }
+    return result;
+  }
+
+private:
+  byte mBits[(N + 7) / 8] = {};
+};
+
+/**
+ * An intrusive singly linked list of elements of type T, which must
+ * have a 'T *next' member. The list doesn't own its elements, which
+ * typically come from a TrackPool.
+ */
+template <class T>
+class TrackList
+{
+public:
+  T *first() const { return mHead; }
+  boolean empty() const { return mHead == nullptr; }
+
+  void push(T *item)
+  {
+    item->next = mHead;
+    mHead = item;
+  }
+
+  /**
+   * Unlinks the given element, returning false if it wasn't listed.
+   */
+  boolean remove(T *item)
+  {
+    for (T **link = &mHead; *link != nullptr; link = &(*link)->next)
+    {
+      if (*link == item)
+      {
+        *link = item->next;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+private:
+  T *mHead = nullptr;
+};
+
+#endif
@@ -18,30 +18,39 @@
 
 #include "RailuinoSeeed.h"
 #include "mcp2515_can.h"
+#include <EEPROM.h>
 
 size_t printHex(Print &p, unsigned long hex, int digits)
 {
 	size_t size = 0;
 
-	String s = String(hex, HEX);
+	// Formatted by hand, a String would need the heap
+	int length = 1;
+	for (unsigned long rest = hex >> 4; rest != 0; rest >>= 4)
+	{
+		length++;
+	}
 
-	for (int i = s.length(); i < digits; i++)
+	for (int i = length; i < digits; i++)
 	{
 		size += p.print("0");
 	}
 
-	size += p.print(s);
+	for (int i = length - 1; i >= 0; i--)
+	{
+		size += p.print("0123456789abcdef"[(hex >> (4 * i)) & 0x0f]);
+	}
 
 	return size;
 }
 
-int parseHex(String &s, int start, int end, boolean *ok)
+int parseHex(const char *s, int start, int end, boolean *ok)
 {
 	int value = 0;
 
 	for (int i = start; i < end; i++)
 	{
-		char c = s.charAt(i);
+		char c = s[i];
 
 		if (c >= '0' && c <= '9')
 		{
@@ -65,10 +74,55 @@ int parseHex(String &s, int start, int end, boolean *ok)
 	return value;
 }
 
+word crc16(word crc, byte value)
+{
+	// CRC-16-CCITT, polynomial 0x1021
+	crc ^= (word)value << 8;
+
+	for (int i = 0; i < 8; i++)
+	{
+		crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+
+	return crc;
+}
+
 #define SIZE 32
 
 #define ulong unsigned long
 
+boolean readCanMessage(MCP_CAN &can, TrackMessage &message)
+{
+	if (CAN_MSGAVAIL != can.checkReceive())
+	{
+		return false;
+	}
+
+	uint32_t id;
+	uint8_t ext;
+	uint8_t rtr;
+	uint8_t len;
+	byte cdata[MAX_CHAR_IN_MESSAGE] = {0};
+
+	// read data, len: data length, buf: data buf
+	can.readMsgBufID(can.readRxTxStatus(), &id, &ext, &rtr, &len, cdata);
+
+	return message.fromCanMsg(id, ext, rtr, len, cdata);
+}
+
+boolean writeCanMessage(MCP_CAN &can, TrackMessage &message)
+{
+	const uint32_t id = ((uint32_t)message.command) << 17 | (uint32_t)message.response << 16 | (uint32_t)message.hash;
+
+	return can.sendMsgBuf(id, 1, 0, message.length, message.data) == CAN_OK;
+}
+
+// System stop or locomotive emergency stop
+boolean isStop(TrackMessage &message)
+{
+	return message.command == 0x00 && message.length >= 5 && (message.data[4] == 0x00 || message.data[4] == 0x03);
+}
+
 // ===================================================================
 // === TrackMessage ==================================================
 // ===================================================================
@@ -105,18 +159,24 @@ size_t TrackMessage::printTo(Print &p) const
 }
 
 boolean TrackMessage::parseFrom(String &s)
+{
+	return parseFrom(s.c_str());
+}
+
+boolean TrackMessage::parseFrom(const char *s)
 {
 	boolean result = true;
+	size_t size = strlen(s);
 
 	clear();
 
-	if (s.length() < 11)
+	if (size < 11)
 	{
 		return false;
 	}
 
 	hash = parseHex(s, 0, 4, &result);
-	response = s.charAt(5) != ' ';
+	response = s[5] != ' ';
 	command = parseHex(s, 7, 9, &result);
 	length = parseHex(s, 10, 11, &result);
 
@@ -125,7 +185,7 @@ boolean TrackMessage::parseFrom(String &s)
 		return false;
 	}
 
-	if (s.length() < 11 + 3 * length)
+	if (size < 11 + 3 * length)
 	{
 		return false;
 	}
@@ -169,256 +229,2171 @@ void TrackController::init(MCP_CAN &aCAN)
 	sendMessage(message);
 }
 
-boolean TrackController::receiveMessage(TrackMessage &message)
+boolean TrackController::init(TrackBus &aBus)
 {
-	unsigned long t = millis();
-
-	if (CAN_MSGAVAIL != mCAN->checkReceive())
+	if (!aBus.attach(*this))
 	{
 		return false;
 	}
 
-	uint32_t id;
-	uint8_t ext;
-	uint8_t rtr;
-	uint8_t len;
-	byte cdata[MAX_CHAR_IN_MESSAGE] = {0};
-
-	// read data, len: data length, buf: data buf
-	mCAN->readMsgBufID(mCAN->readRxTxStatus(), &id, &ext, &rtr, &len, cdata);
+	mBus = &aBus;
+	init(*aBus.mCAN);
 
-	message.fromCanMsg(id, ext, rtr, len, cdata);
-	if (mDebug)
-	{
-		SERIAL_PORT_MONITOR.print("<== ");
-		SERIAL_PORT_MONITOR.println(message);
-	}
 	return true;
 }
 
-boolean TrackController::sendMessage(TrackMessage &message)
+void TrackController::init(MCP_CAN &aPrimary, MCP_CAN &aSecondary)
 {
-	message.hash = mHash;
+	mStandby = &aSecondary;
+	mStandbyOnly = false;
 
-	const uint32_t id = ((uint32_t)message.command) << 17 | (uint32_t)message.hash;
-	const uint8_t ext = 1;
-	const uint8_t rtr = 0;
+	init(aPrimary);
+}
 
-	if (mDebug)
-	{
-		SERIAL_PORT_MONITOR.print("==> ");
-		SERIAL_PORT_MONITOR.println(message);
-	}
+word TrackController::getFailovers()
+{
+	return mFailovers;
+}
+
+void TrackController::failover()
+{
+	MCP_CAN *can = mCAN;
+	mCAN = mStandby;
+	mStandby = can;
+
+	mStandbyOnly = false;
+	mFailovers++;
 
-	byte result = mCAN->sendMsgBuf(id, ext, rtr, message.length, message.data);
 	if (mDebug)
 	{
-		SERIAL_PORT_MONITOR.print("  result ");
-		SERIAL_PORT_MONITOR.println(result, HEX);
+		SERIAL_PORT_MONITOR.println(F("!!! Failover"));
 	}
-	return result == CAN_OK;
 }
 
-boolean TrackController::exchangeMessage(TrackMessage &out, TrackMessage &in, word timeout)
+void TrackController::update()
 {
-	int command = out.command;
+	service(nullptr);
+}
 
-	if (!sendMessage(out))
+#if RAILUINO_GATEWAY
+void TrackController::serve(Stream &stream)
+{
+	TrackMessage message;
+
+	while (stream.available() > 0)
 	{
-		if (true)
+		char c = stream.read();
+
+		if (c != '\r' && c != '\n')
 		{
-			if (mDebug)
+			// Overlong lines are invalid anyway, so truncating is fine
+			if (mLineLength < RAILUINO_LINE - 1)
 			{
-				SERIAL_PORT_MONITOR.println(F("!!! Send error"));
-				SERIAL_PORT_MONITOR.println(F("!!! Emergency stop"));
+				mLine[mLineLength++] = c;
 			}
-			for (;;)
-				;
+			continue;
 		}
-	}
 
-	ulong time = millis();
-	while (millis() < time + timeout)
-	{
-		in.clear();
-		boolean result = receiveMessage(in);
+		if (mLineLength == 0)
+		{
+			continue;
+		}
 
-		if (result && in.command == command && in.response)
+		mLine[mLineLength] = 0;
+		mLineLength = 0;
+
+		if (mLine[0] == '?' && mLine[1] == 0)
 		{
-			return true;
+			dumpState(stream);
 		}
-	}
+		else if (message.parseFrom(mLine))
+		{
+			Queued queued = {message, millis()};
+			boolean stop = isStop(message);
 
-	if (mDebug)
-	{
-		SERIAL_PORT_MONITOR.println(F("!!! Receive timeout"));
+			Client *client = findClient(message.hash, true);
+			if (!(stop ? mStops.push(queued) : client->queue.push(queued)))
+			{
+				client->dropped++;
+				stream.println(F("!!! Queue full"));
+			}
+		}
+		else
+		{
+			stream.println(F("!!! Parse error"));
+		}
 	}
 
-	return false;
+	service(&stream);
 }
 
-boolean TrackController::setPower(boolean power)
+TrackController::Client *TrackController::findClient(word hash, boolean create)
 {
-	TrackMessage message;
-
-	if (power)
+	for (int i = 0; i < mClientCount; i++)
 	{
-		message.clear();
-		message.command = 0x00;
-		message.length = 0x07;
-		message.data[4] = 9;
-		message.data[6] = 0xD;
-
-		exchangeMessage(message, message, 1000);
+		if (mClients[i].hash == hash)
+		{
+			return &mClients[i];
+		}
+	}
 
-		message.clear();
-		message.command = 0x00;
-		message.length = 0x06;
-		message.data[4] = 8;
-		message.data[5] = 7;
+	if (!create)
+	{
+		return nullptr;
+	}
 
-		exchangeMessage(message, message, 1000);
+	// Further tools have to share the last queue
+	if (mClientCount == RAILUINO_CLIENTS)
+	{
+		return &mClients[RAILUINO_CLIENTS - 1];
 	}
 
-	message.clear();
-	message.command = 0x00;
-	message.length = 0x05;
-	message.data[4] = power ? 0x01 : 0x00;
+	Client *client = &mClients[mClientCount++];
 
-	return exchangeMessage(message, message, 1000);
+	client->hash = hash;
+	client->weight = 1;
+	client->deficit = 0;
+	client->wait = 0;
+	client->dropped = 0;
+	client->queue.clear();
+
+	return client;
 }
 
-boolean TrackController::setPower2(boolean power)
+boolean TrackController::setClientWeight(word hash, byte weight)
 {
-	TrackMessage message;
+	if (findClient(hash, false) == nullptr && mClientCount == RAILUINO_CLIENTS)
+	{
+		return false;
+	}
 
-	message.clear();
-	message.command = 0x00;
-	message.length = 0x05;
-	message.data[4] = power ? 0x01 : 0x00;
+	findClient(hash, true)->weight = weight != 0 ? weight : 1;
 
-	return sendMessage(message);
+	return true;
 }
 
-boolean TrackController::getPower(boolean *power)
+unsigned long TrackController::getClientWait(word hash, word *dropped)
 {
-	TrackMessage message;
-
-	message.clear();
-	message.command = 0x00;
-	message.length = 0x04;
-
-	if (exchangeMessage(message, message, 1000))
+	Client *client = findClient(hash, false);
+	if (client == nullptr)
 	{
-		*power = message.data[4];
-		return true;
+		if (dropped != nullptr)
+		{
+			*dropped = 0;
+		}
+		return 0;
 	}
-	else
+
+	unsigned long wait = client->wait;
+	client->wait = 0;
+
+	if (dropped != nullptr)
 	{
-		return false;
+		*dropped = client->dropped;
 	}
+
+	return wait;
 }
 
-boolean TrackController::getPower2(void)
+void TrackController::transmit()
 {
-	TrackMessage message;
+	// A full frame with some room for bit stuffing
+	const word quantum = 160;
 
-	message.clear();
-	message.command = 0x00;
-	message.length = 0x04;
+	byte budget = RAILUINO_UPDATE_BUDGET;
+	Queued *queued;
 
-	return sendMessage(message);
-}
+	while (budget > 0 && (queued = mStops.peek()) != nullptr)
+	{
+		if (!writeCanMessage(*mCAN, queued->message))
+		{
+			return;
+		}
 
-boolean TrackController::setLocoDirection(word address, byte direction)
-{
-	TrackMessage message;
+		Queued sent;
+		mStops.pop(sent);
 
-	message.clear();
-	message.command = 0x00;
-	message.length = 0x05;
-	message.data[2] = highByte(address);
-	message.data[3] = lowByte(address);
-	message.data[4] = 0x03;
+		countFrame(sent.message.length, true);
+		budget--;
+	}
 
-	exchangeMessage(message, message, 1000);
+	// Deficit round-robin, charging each message its bits on the bus
+	byte visits = 0;
+	while (budget > 0 && mClientCount != 0 && visits <= mClientCount)
+	{
+		Client *client = &mClients[mClientTurn];
 
-	message.clear();
-	message.command = 0x05;
-	message.length = 0x05;
-	message.data[2] = highByte(address);
-	message.data[3] = lowByte(address);
-	message.data[4] = direction;
+		if (!mClientCredited)
+		{
+			client->deficit += client->weight * quantum;
+			mClientCredited = true;
+		}
 
-	return exchangeMessage(message, message, 1000);
-}
+		queued = client->queue.peek();
+		if (queued != nullptr && client->deficit >= 67 + 8 * queued->message.length)
+		{
+			// Try again next time if the transmit buffers are busy
+			if (!writeCanMessage(*mCAN, queued->message))
+			{
+				return;
+			}
 
-boolean TrackController::toggleLocoDirection(word address)
-{
-	return setLocoDirection(address, DIR_CHANGE);
-}
+			Queued sent;
+			client->queue.pop(sent);
 
-boolean TrackController::setLocoSpeed(word address, word speed)
-{
-	TrackMessage message;
+			countFrame(sent.message.length, true);
+			client->deficit -= 67 + 8 * sent.message.length;
+			if (millis() - sent.time > client->wait)
+			{
+				client->wait = millis() - sent.time;
+			}
+			budget--;
+			visits = 0;
+			continue;
+		}
 
-	message.clear();
-	message.command = 0x04;
-	message.length = 0x06;
-	message.data[2] = highByte(address);
-	message.data[3] = lowByte(address);
-	message.data[4] = highByte(speed);
-	message.data[5] = lowByte(speed);
+		// An idle queue doesn't save up for later
+		if (queued == nullptr)
+		{
+			client->deficit = 0;
+		}
 
-	return exchangeMessage(message, message, 1000);
+		mClientTurn = (mClientTurn + 1) % mClientCount;
+		mClientCredited = false;
+		visits++;
+	}
 }
 
-boolean TrackController::accelerateLoco(word address)
+void TrackController::dumpState(Print &p)
 {
-	word speed;
-
-	if (getLocoSpeed(address, &speed))
+	for (int i = 0; i < RAILUINO_LOCO_STATES; i++)
 	{
-		speed += 77;
-		if (speed > 1023)
+		const LocoState *loco = &mLocos[i];
+		if (loco->address != 0)
 		{
-			speed = 1023;
+			p.print("L ");
+			printHex(p, loco->address, 4);
+			p.print(" ");
+			printHex(p, loco->speed, 4);
+			p.print(" ");
+			printHex(p, loco->direction, 2);
+			p.print(" ");
+			printHex(p, loco->functions, 8);
+			p.println();
 		}
-
-		return setLocoSpeed(address, speed);
 	}
 
-	return false;
+	for (int i = 0; i < RAILUINO_ACC_STATES; i++)
+	{
+		const AccessoryState *accessory = &mAccessories[i];
+		if (accessory->address != 0 && accessory->position != 0xff)
+		{
+			p.print("A ");
+			printHex(p, accessory->address, 4);
+			p.print(" ");
+			printHex(p, accessory->position, 2);
+			p.print(" ");
+			printHex(p, accessory->power, 2);
+			p.println();
+		}
+	}
 }
+#endif
 
-boolean TrackController::decelerateLoco(word address)
+void TrackController::service(Print *echo)
 {
-	word speed;
+	TrackMessage message;
+	boolean quiet = true;
+	byte budget = RAILUINO_UPDATE_BUDGET;
 
-	if (getLocoSpeed(address, &speed))
+	while (budget > 0 && receiveMessage(message))
 	{
-		speed -= 77;
-		if (speed > 32767)
+		budget--;
+		quiet = false;
+
+		if (echo != nullptr)
 		{
-			speed = 0;
+			echo->println(message);
 		}
-
-		return setLocoSpeed(address, speed);
 	}
 
-	return false;
-}
+#if RAILUINO_GATEWAY
+	transmit();
+#endif
 
-boolean TrackController::setLocoFunction(word address, byte function, byte power)
-{
-	TrackMessage message;
+	if (mLinkInterval != 0 && millis() - mPingTime >= mLinkInterval)
+	{
+		if (mPingPending)
+		{
+			mLinkLoss++;
 
-	message.clear();
-	message.command = 0x06;
-	message.length = 0x06;
-	message.data[2] = highByte(address);
-	message.data[3] = lowByte(address);
-	message.data[4] = function;
+			if (mLinkMisses < 255)
+			{
+				mLinkMisses++;
+			}
+
+			if (mLinkUp && mLinkMisses >= mLinkThreshold)
+			{
+				mLinkUp = false;
+
+				if (mDebug)
+				{
+					SERIAL_PORT_MONITOR.println(F("!!! Link down"));
+				}
+
+				if (mLinkHandler != nullptr)
+				{
+					mLinkHandler(false);
+				}
+			}
+		}
+
+		message.clear();
+		message.command = 0x18;
+
+		mPingPending = sendMessage(message);
+		mPingTime = millis();
+		mPingSent = micros();
+	}
+
+	releasePulses();
+
+	if (mRevalidateInterval != 0 && mCachedReads && mTtl != 0 && quiet && millis() - mRevalidateTime >= mRevalidateInterval)
+	{
+		revalidate();
+		mRevalidateTime = millis();
+	}
+
+#if RAILUINO_RECENT_LOCOS
+	// Prefetches only have to wait until the responses are read
+	if (budget > 0)
+	{
+		prefetch();
+	}
+#endif
+
+	if (mSweepNext != 0 && quiet && millis() - mSweepTime >= mSweepInterval)
+	{
+		getAccessory2(mSweepNext);
+
+		mSweepNext = mSweepNext < mSweepLast ? mSweepNext + 1 : 0;
+		mSweepTime = millis();
+	}
+}
+
+boolean TrackController::receiveMessage(TrackMessage &message)
+{
+	// The bus has already handed the message to observe()
+	if (mBus != nullptr)
+	{
+		if (!mBus->receive(*this, message))
+		{
+			return false;
+		}
+
+		if (mDebug)
+		{
+			SERIAL_PORT_MONITOR.print("<== ");
+			SERIAL_PORT_MONITOR.println(message);
+		}
+
+		countFrame(message.length, false);
+
+		return true;
+	}
+
+	boolean result = readCanMessage(*mCAN, message);
+	if (result)
+	{
+		mStandbyOnly = false;
+	}
+
+	// The standby interface sees the same messages, so they are only
+	// drained to tell whether the active one still receives. Only if
+	// the standby one keeps receiving for a while when the active one
+	// doesn't receive anything at all, the active one has failed.
+	if (mStandby != nullptr)
+	{
+		TrackMessage ignored;
+		byte budget = RAILUINO_UPDATE_BUDGET;
+
+		while (budget-- > 0 && readCanMessage(*mStandby, ignored))
+		{
+			if (result)
+			{
+				continue;
+			}
+
+			if (!mStandbyOnly)
+			{
+				mStandbyOnly = true;
+				mStandbyTime = millis();
+			}
+			else if (millis() - mStandbyTime > RAILUINO_FAILOVER_SILENCE)
+			{
+				failover();
+				break;
+			}
+		}
+	}
+
+	if (!result)
+	{
+		return false;
+	}
+
+	if (mDebug)
+	{
+		SERIAL_PORT_MONITOR.print("<== ");
+		SERIAL_PORT_MONITOR.println(message);
+	}
+
+	countFrame(message.length, false);
+
+	observe(message);
+
+	return true;
+}
+
+void TrackController::flushBus()
+{
+	if (mBus != nullptr)
+	{
+		mBus->flush(*this);
+	}
+}
+
+boolean TrackController::sendMessage(TrackMessage &message)
+{
+	message.hash = mHash;
+
+	const uint32_t id = ((uint32_t)message.command) << 17 | (uint32_t)message.hash;
+	const uint8_t ext = 1;
+	const uint8_t rtr = 0;
+
+	if (mDebug)
+	{
+		SERIAL_PORT_MONITOR.print("==> ");
+		SERIAL_PORT_MONITOR.println(message);
+	}
+
+	byte result = mCAN->sendMsgBuf(id, ext, rtr, message.length, message.data);
+	if (result != CAN_OK && mStandby != nullptr)
+	{
+		failover();
+		result = mCAN->sendMsgBuf(id, ext, rtr, message.length, message.data);
+	}
+
+	if (result == CAN_OK)
+	{
+		countFrame(message.length, true);
+	}
+
+	if (mDebug)
+	{
+		SERIAL_PORT_MONITOR.print("  result ");
+		SERIAL_PORT_MONITOR.println(result, HEX);
+	}
+	return result == CAN_OK;
+}
+
+uint32_t targetOf(TrackMessage &message)
+{
+	return (uint32_t)message.data[0] << 24 | (uint32_t)message.data[1] << 16 | (uint32_t)message.data[2] << 8 | message.data[3];
+}
+
+TrackController::Breaker *TrackController::findBreaker(uint32_t target, boolean create)
+{
+	Breaker *victim = &mBreakers[0];
+
+	for (int i = 0; i < RAILUINO_BREAKER_TARGETS; i++)
+	{
+		Breaker *breaker = &mBreakers[i];
+
+		if (breaker->failures != 0 && breaker->target == target)
+		{
+			return breaker;
+		}
+
+		if (breaker->failures < victim->failures)
+		{
+			victim = breaker;
+		}
+	}
+
+	if (!create)
+	{
+		return nullptr;
+	}
+
+	victim->target = target;
+	victim->failures = 0;
+	victim->until = 0;
+
+	return victim;
+}
+
+void TrackController::setCircuitBreaker(byte threshold, word backoff)
+{
+	mBreakerThreshold = threshold;
+	mBreakerBackoff = backoff;
+
+	for (int i = 0; i < RAILUINO_BREAKER_TARGETS; i++)
+	{
+		mBreakers[i].failures = 0;
+	}
+}
+
+boolean TrackController::isReachable(uint32_t target)
+{
+	Breaker *breaker = findBreaker(target, false);
+
+	return breaker == nullptr || breaker->failures < mBreakerThreshold || (long)(millis() - breaker->until) >= 0;
+}
+
+TrackController::LocoState *TrackController::findLoco(word address, boolean create)
+{
+	LocoState *victim = nullptr;
+	unsigned long victimStamp = 0;
+
+	for (int i = 0; i < RAILUINO_LOCO_STATES; i++)
+	{
+		LocoState *loco = &mLocos[i];
+
+		if (loco->address == address)
+		{
+			return loco;
+		}
+
+		// Whichever of its states was seen last counts
+		unsigned long stamp = (long)(loco->functionStamp - loco->stamp) > 0 ? loco->functionStamp : loco->stamp;
+
+		if (victim == nullptr || loco->address == 0 || (victim->address != 0 && (long)(stamp - victimStamp) < 0))
+		{
+			victim = loco;
+			victimStamp = stamp;
+		}
+	}
+
+	if (!create || address == 0)
+	{
+		return nullptr;
+	}
+
+	victim->address = address;
+	victim->flags = 0;
+	victim->known = 0;
+	victim->stamp = millis();
+	victim->functionStamp = victim->stamp;
+
+	return victim;
+}
+
+TrackController::AccessoryState *TrackController::findAccessory(word address, boolean create)
+{
+	AccessoryState *victim = &mAccessories[0];
+
+	for (int i = 0; i < RAILUINO_ACC_STATES; i++)
+	{
+		AccessoryState *accessory = &mAccessories[i];
+
+		if (accessory->address == address)
+		{
+			return accessory;
+		}
+
+		if (accessory->address == 0 || (victim->address != 0 && (long)(accessory->stamp - victim->stamp) < 0))
+		{
+			victim = accessory;
+		}
+	}
+
+	if (!create || address == 0)
+	{
+		return nullptr;
+	}
+
+	victim->address = address;
+	victim->position = 0xff;
+	victim->stamp = millis();
+
+	return victim;
+}
+
+TrackController::LocoState *TrackController::findCachedLoco(word address, boolean functions)
+{
+	LocoState *loco = mCachedReads ? findLoco(address, false) : nullptr;
+	if (loco == nullptr || (mTtl != 0 && millis() - (functions ? loco->functionStamp : loco->stamp) >= mTtl))
+	{
+		return nullptr;
+	}
+
+	if (loco->reads < 255)
+	{
+		loco->reads++;
+	}
+
+	return loco;
+}
+
+#if RAILUINO_RECENT_LOCOS
+boolean TrackController::isKnownLoco(word address)
+{
+	const uint32_t functions = RAILUINO_PREFETCH_FUNCTIONS >= 32 ? 0xffffffff : ((uint32_t)1 << RAILUINO_PREFETCH_FUNCTIONS) - 1;
+
+	LocoState *loco = findLoco(address, false);
+	return loco != nullptr && (loco->flags & LOCO_SPEED) && (loco->flags & LOCO_DIRECTION) && (loco->known & functions) == functions && (mTtl == 0 || (millis() - loco->stamp < mTtl && millis() - loco->functionStamp < mTtl));
+}
+#endif
+
+boolean TrackController::isFresh(unsigned long stamp)
+{
+	return mResync == 0 || millis() - stamp < mResync;
+}
+
+boolean isOverload(TrackMessage &message)
+{
+	return message.command == 0x00 && message.length >= 5 && message.data[4] == 0x0a;
+}
+
+void TrackController::observe(TrackMessage &message)
+{
+	// S88 contact event
+	if (message.command == 0x11 && message.length == 8 && message.data[4] != message.data[5])
+	{
+		word device = word(message.data[0], message.data[1]);
+		word contact = word(message.data[2], message.data[3]);
+
+		publish(CHANGE_SENSOR, contact, lowByte(device), message.data[5]);
+
+#if RAILUINO_REFLEXES
+		byte edge = message.data[5] ? EDGE_RISING : EDGE_FALLING;
+
+		for (int i = 0; i < mReflexCount; i++)
+		{
+			Reflex *reflex = &mReflexes[i];
+
+			if (reflex->contact == contact && reflex->device == device && (reflex->edge & edge))
+			{
+				TrackMessage reaction;
+
+				reaction.clear();
+				reaction.command = reflex->command;
+				reaction.length = reflex->length;
+				memcpy(reaction.data, reflex->data, sizeof(reaction.data));
+
+				sendMessage(reaction);
+			}
+		}
+#endif
+	}
+
+	if (isOverload(message))
+	{
+		uint32_t uid = targetOf(message);
+		byte channel = message.length >= 6 ? message.data[5] : 0;
+
+#if RAILUINO_OVERLOAD_DEVICES
+		// The device's own entry, else a free one, else the oldest one
+		Overload *overload = nullptr;
+		for (int i = 0; i < RAILUINO_OVERLOAD_DEVICES && overload == nullptr; i++)
+		{
+			if (mOverloads[i].channels != 0 && mOverloads[i].uid == uid)
+			{
+				overload = &mOverloads[i];
+			}
+		}
+
+		for (int i = 0; i < RAILUINO_OVERLOAD_DEVICES && overload == nullptr; i++)
+		{
+			if (mOverloads[i].channels == 0)
+			{
+				overload = &mOverloads[i];
+			}
+		}
+
+		if (overload == nullptr)
+		{
+			overload = &mOverloads[0];
+			for (int i = 1; i < RAILUINO_OVERLOAD_DEVICES; i++)
+			{
+				if ((long)(mOverloads[i].time - overload->time) < 0)
+				{
+					overload = &mOverloads[i];
+				}
+			}
+		}
+
+		if (overload->uid != uid)
+		{
+			overload->channels = 0;
+		}
+
+		overload->uid = uid;
+		overload->channels |= 1 << (channel & 7);
+		overload->time = millis();
+#endif
+		mOverloadCount++;
+
+		if (mOverloadHalt)
+		{
+			setPower2(false);
+		}
+
+		if (mOverloadHandler != nullptr)
+		{
+			mOverloadHandler(uid, channel);
+		}
+
+		return;
+	}
+
+	if (!message.response)
+	{
+		return;
+	}
+
+	// Ping response
+	if (message.command == 0x18 && mPingPending && (mLinkUid == 0 || targetOf(message) == mLinkUid))
+	{
+		unsigned long rtt = micros() - mPingSent;
+
+		// Exponentially weighted moving average, alpha = 1/8
+		mLinkRtt = mLinkRtt == 0 ? rtt : mLinkRtt - mLinkRtt / 8 + rtt / 8;
+		mLinkMisses = 0;
+		mPingPending = false;
+
+		if (!mLinkUp)
+		{
+			mLinkUp = true;
+
+			if (mDebug)
+			{
+				SERIAL_PORT_MONITOR.println(F("!!! Link up"));
+			}
+
+			if (mLinkHandler != nullptr)
+			{
+				mLinkHandler(true);
+			}
+		}
+
+		return;
+	}
+
+	word address = word(message.data[2], message.data[3]);
+
+	switch (message.command)
+	{
+	case 0x00:
+		// System stop and go
+		if (message.length == 5 && message.data[4] <= 0x01)
+		{
+			publish(CHANGE_POWER, 0, 0, message.data[4]);
+		}
+		// Locomotive emergency stop
+		else if (message.length == 5 && message.data[4] == 0x03)
+		{
+			LocoState *loco = findLoco(address, false);
+			if (loco != nullptr)
+			{
+				if (!(loco->flags & LOCO_SPEED) || loco->speed != 0)
+				{
+					publish(CHANGE_SPEED, address, 0, 0);
+				}
+				loco->speed = 0;
+				loco->flags |= LOCO_SPEED;
+				loco->stamp = millis();
+			}
+		}
+		break;
+
+	case 0x04:
+		if (message.length == 6)
+		{
+			LocoState *loco = findLoco(address, true);
+			word speed = word(message.data[4], message.data[5]);
+			if (!(loco->flags & LOCO_SPEED) || loco->speed != speed)
+			{
+				publish(CHANGE_SPEED, address, 0, speed);
+			}
+			loco->speed = speed;
+			loco->flags |= LOCO_SPEED;
+			loco->stamp = millis();
+		}
+		break;
+
+	case 0x05:
+		if (message.length == 5)
+		{
+			// Changing the direction also stops the locomotive, but
+			// the answer to a query looks just the same, so only a
+			// different direction tells that it has been changed
+			LocoState *loco = findLoco(address, true);
+			boolean changed = (loco->flags & LOCO_DIRECTION) && loco->direction != message.data[4];
+			if (!(loco->flags & LOCO_DIRECTION) || changed)
+			{
+				publish(CHANGE_DIRECTION, address, 0, message.data[4]);
+			}
+			if (changed && (!(loco->flags & LOCO_SPEED) || loco->speed != 0))
+			{
+				publish(CHANGE_SPEED, address, 0, 0);
+			}
+			loco->direction = message.data[4];
+			loco->flags |= LOCO_DIRECTION;
+			if (changed)
+			{
+				loco->speed = 0;
+				loco->flags |= LOCO_SPEED;
+			}
+			loco->stamp = millis();
+		}
+		break;
+
+	case 0x06:
+		if (message.length == 6 && message.data[4] < 32)
+		{
+			LocoState *loco = findLoco(address, true);
+			uint32_t mask = (uint32_t)1 << message.data[4];
+			uint32_t value = message.data[5] != 0 ? mask : 0;
+			if (!(loco->known & mask) || (loco->functions & mask) != value)
+			{
+				publish(CHANGE_FUNCTION, address, message.data[4], message.data[5]);
+			}
+			loco->functions = (loco->functions & ~mask) | value;
+			loco->known |= mask;
+			loco->functionStamp = millis();
+		}
+		break;
+
+	case 0x0b:
+		if (message.length >= 6)
+		{
+			AccessoryState *accessory = findAccessory(address, true);
+			if (accessory->position != message.data[4] || accessory->power != message.data[5])
+			{
+				publish(CHANGE_ACCESSORY, address, message.data[5], message.data[4]);
+			}
+			accessory->position = message.data[4];
+			accessory->power = message.data[5];
+			accessory->stamp = millis();
+		}
+		break;
+	}
+}
+
+void TrackController::publish(byte type, word address, byte index, word value)
+{
+#if RAILUINO_CHANGES
+	TrackChange *change = &mChanges[mChangeSequence % RAILUINO_CHANGES];
+
+	change->type = type;
+	change->index = index;
+	change->address = address;
+	change->value = value;
+	change->time = millis();
+
+	mChangeSequence++;
+#else
+	(void)type;
+	(void)address;
+	(void)index;
+	(void)value;
+#endif
+}
+
+#if RAILUINO_CHANGES
+void TrackController::subscribe(TrackSubscriber &subscriber, byte mask)
+{
+	subscriber.sequence = mChangeSequence;
+	subscriber.mask = mask;
+	subscriber.lost = 0;
+}
+
+boolean TrackController::nextChange(TrackSubscriber &subscriber, TrackChange *change)
+{
+	// Skip whatever has been overwritten in the meantime
+	word behind = mChangeSequence - subscriber.sequence;
+	if (behind > RAILUINO_CHANGES)
+	{
+		subscriber.lost += behind - RAILUINO_CHANGES;
+		subscriber.sequence = mChangeSequence - RAILUINO_CHANGES;
+	}
+
+	while (subscriber.sequence != mChangeSequence)
+	{
+		TrackChange *next = &mChanges[subscriber.sequence % RAILUINO_CHANGES];
+		subscriber.sequence++;
+
+		if (next->type & subscriber.mask)
+		{
+			*change = *next;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+size_t writeChange(Print &p, byte type, byte index, word address, word value)
+{
+	byte record[6] = {type, index, highByte(address), lowByte(address), highByte(value), lowByte(value)};
+
+	return p.write(record, sizeof(record));
+}
+
+size_t TrackController::pushChanges(Print &p, TrackSubscriber &subscriber)
+{
+	size_t size = 0;
+	TrackChange change;
+
+	while (nextChange(subscriber, &change))
+	{
+		size += writeChange(p, change.type, change.index, change.address, change.value);
+	}
+
+	return size;
+}
+
+size_t TrackController::pushSnapshot(Print &p, TrackSubscriber &subscriber)
+{
+	size_t size = 0;
+	byte mask = subscriber.mask;
+
+	for (int i = 0; i < RAILUINO_LOCO_STATES; i++)
+	{
+		const LocoState *loco = &mLocos[i];
+		if (loco->address == 0)
+		{
+			continue;
+		}
+
+		if ((mask & CHANGE_SPEED) && (loco->flags & LOCO_SPEED))
+		{
+			size += writeChange(p, CHANGE_SPEED, 0, loco->address, loco->speed);
+		}
+
+		if ((mask & CHANGE_DIRECTION) && (loco->flags & LOCO_DIRECTION))
+		{
+			size += writeChange(p, CHANGE_DIRECTION, 0, loco->address, loco->direction);
+		}
+
+		for (byte function = 0; function < 32 && (mask & CHANGE_FUNCTION); function++)
+		{
+			if (bitRead(loco->known, function))
+			{
+				size += writeChange(p, CHANGE_FUNCTION, function, loco->address, bitRead(loco->functions, function));
+			}
+		}
+	}
+
+	for (int i = 0; i < RAILUINO_ACC_STATES && (mask & CHANGE_ACCESSORY); i++)
+	{
+		const AccessoryState *accessory = &mAccessories[i];
+		if (accessory->address != 0 && accessory->position != 0xff)
+		{
+			size += writeChange(p, CHANGE_ACCESSORY, accessory->power, accessory->address, accessory->position);
+		}
+	}
+
+	return size;
+}
+#endif
+
+void TrackController::setWriteElision(boolean enabled, unsigned long resync)
+{
+	mElision = enabled;
+	mResync = resync;
+}
+
+void TrackController::setSpeedQuantisation(boolean enabled)
+{
+	mQuantise = enabled;
+}
+
+void TrackController::setCachedReads(boolean enabled, unsigned long ttl)
+{
+	mCachedReads = enabled;
+	mTtl = ttl;
+}
+
+void TrackController::setRevalidation(word interval)
+{
+	mRevalidateInterval = interval;
+	mRevalidateTime = millis();
+}
+
+void TrackController::revalidate()
+{
+	LocoState *bestLoco = nullptr;
+	AccessoryState *bestAccessory = nullptr;
+	byte bestReads = 0;
+	unsigned long bestAge = mTtl / 2;
+
+	// Most read first, then oldest, among those past half their time;
+	// function states are many frames to query, so they just expire
+	for (int i = 0; i < RAILUINO_LOCO_STATES; i++)
+	{
+		LocoState *loco = &mLocos[i];
+		unsigned long age = millis() - loco->stamp;
+
+		if (loco->address != 0 && age >= mTtl / 2 && (loco->reads > bestReads || (loco->reads == bestReads && age >= bestAge)))
+		{
+			bestLoco = loco;
+			bestReads = loco->reads;
+			bestAge = age;
+		}
+	}
+
+	for (int i = 0; i < RAILUINO_ACC_STATES; i++)
+	{
+		AccessoryState *accessory = &mAccessories[i];
+		unsigned long age = millis() - accessory->stamp;
+
+		if (accessory->address != 0 && age >= mTtl / 2 && (accessory->reads > bestReads || (accessory->reads == bestReads && age >= bestAge)))
+		{
+			bestLoco = nullptr;
+			bestAccessory = accessory;
+			bestReads = accessory->reads;
+			bestAge = age;
+		}
+	}
+
+	TrackMessage message;
+
+	message.clear();
+	message.length = 0x04;
+
+	// Halve the read count so that other entries get their turn, too
+	if (bestLoco != nullptr)
+	{
+		bestLoco->reads /= 2;
+
+		message.data[2] = highByte(bestLoco->address);
+		message.data[3] = lowByte(bestLoco->address);
+
+		message.command = 0x04;
+		sendMessage(message);
+
+		message.command = 0x05;
+		sendMessage(message);
+	}
+	else if (bestAccessory != nullptr)
+	{
+		bestAccessory->reads /= 2;
+
+		message.data[2] = highByte(bestAccessory->address);
+		message.data[3] = lowByte(bestAccessory->address);
+
+		message.command = 0x0b;
+		sendMessage(message);
+	}
+}
+
+#if RAILUINO_RECENT_LOCOS
+void TrackController::prefetchLoco(word address)
+{
+	if (address == 0)
+	{
+		return;
+	}
+
+	// Move to the front of the recently used list
+	byte i = 0;
+	while (i < RAILUINO_RECENT_LOCOS - 1 && mRecent[i] != address)
+	{
+		i++;
+	}
+
+	for (; i > 0; i--)
+	{
+		mRecent[i] = mRecent[i - 1];
+	}
+
+	mRecent[0] = address;
+
+	// The selected locomotive always comes first
+	mPrefetchAddress = address;
+	mPrefetchStep = 0;
+	mPrefetches.clear();
+
+	for (i = 1; i <= mNeighbours && i < RAILUINO_RECENT_LOCOS && mRecent[i] != 0; i++)
+	{
+		if (!isKnownLoco(mRecent[i]))
+		{
+			mPrefetches.push(mRecent[i]);
+		}
+	}
+}
+
+void TrackController::setPrefetchNeighbours(byte count)
+{
+	mNeighbours = count;
+}
+
+void TrackController::prefetch()
+{
+	if (mPrefetchAddress == 0 && !mPrefetches.pop(mPrefetchAddress))
+	{
+		return;
+	}
+
+	TrackMessage message;
+
+	message.clear();
+	message.data[2] = highByte(mPrefetchAddress);
+	message.data[3] = lowByte(mPrefetchAddress);
+
+	// Speed, direction, then the functions one after the other
+	if (mPrefetchStep == 0)
+	{
+		message.command = 0x04;
+		message.length = 0x04;
+	}
+	else if (mPrefetchStep == 1)
+	{
+		message.command = 0x05;
+		message.length = 0x04;
+	}
+	else
+	{
+		message.command = 0x06;
+		message.length = 0x05;
+		message.data[4] = mPrefetchStep - 2;
+	}
+
+	if (!sendMessage(message))
+	{
+		return;
+	}
+
+	if (++mPrefetchStep >= 2 + RAILUINO_PREFETCH_FUNCTIONS)
+	{
+		mPrefetchAddress = 0;
+		mPrefetchStep = 0;
+	}
+}
+#endif
+
+void TrackController::sweepAccessories(word first, word last, word interval)
+{
+	mSweepNext = first;
+	mSweepLast = last;
+	mSweepInterval = interval;
+	mSweepTime = millis() - interval;
+}
+
+#if RAILUINO_UPLOAD_WINDOW
+void TrackController::sendBlock(Upload &upload, byte index)
+{
+	TrackMessage message;
+	byte buffer[64] = {};
+
+	uint32_t offset = (uint32_t)upload.blocks[index].number * 64;
+	byte length = upload.size - offset < 64 ? upload.size - offset : 64;
+
+	upload.reader(offset, buffer, length);
+
+	word crc = 0xffff;
+	for (int i = 0; i < length; i++)
+	{
+		crc = crc16(crc, buffer[i]);
+	}
+
+	upload.blocks[index].crc = crc;
+	upload.blocks[index].state = BLOCK_SENT;
+	upload.blocks[index].tries++;
+
+	message.clear();
+	message.command = upload.command;
+	message.length = 0x07;
+	message.data[0] = upload.uid >> 24;
+	message.data[1] = upload.uid >> 16;
+	message.data[2] = upload.uid >> 8;
+	message.data[3] = upload.uid;
+	message.data[4] = 0x44;
+	message.data[5] = highByte(upload.blocks[index].number);
+	message.data[6] = lowByte(upload.blocks[index].number);
+
+	sendMessage(message);
+
+	// The hash numbers the data frames, which may overtake each other
+	for (int i = 0; i < length; i += 8)
+	{
+		receiveAcks(upload);
+
+		message.clear();
+		message.command = upload.command;
+		message.hash = 0x0300 + i / 8;
+		message.length = 0x08;
+		memcpy(message.data, buffer + i, 8);
+
+		if (writeCanMessage(*mCAN, message))
+		{
+			countFrame(message.length, true);
+		}
+	}
+
+	message.clear();
+	message.command = upload.command;
+	message.length = 0x08;
+	message.data[0] = upload.uid >> 24;
+	message.data[1] = upload.uid >> 16;
+	message.data[2] = upload.uid >> 8;
+	message.data[3] = upload.uid;
+	message.data[4] = 0x88;
+	message.data[5] = lowByte(upload.blocks[index].number);
+	message.data[6] = highByte(crc);
+	message.data[7] = lowByte(crc);
+
+	sendMessage(message);
+
+	upload.blocks[index].time = millis();
+}
+
+void TrackController::receiveAcks(Upload &upload)
+{
+	TrackMessage message;
+
+	while (receiveMessage(message))
+	{
+		if (!message.response || message.command != upload.command || message.length < 6 || targetOf(message) != upload.uid || (message.data[4] != 0x88 && message.data[4] != 0xf1))
+		{
+			continue;
+		}
+
+		for (int i = 0; i < RAILUINO_UPLOAD_WINDOW; i++)
+		{
+			if (upload.blocks[i].state == BLOCK_SENT && lowByte(upload.blocks[i].number) == message.data[5])
+			{
+				if (message.data[4] == 0x88 && message.length == 8 && word(message.data[6], message.data[7]) == upload.blocks[i].crc)
+				{
+					upload.blocks[i].state = BLOCK_FREE;
+					upload.acked++;
+				}
+				else
+				{
+					upload.blocks[i].state = BLOCK_RESEND;
+				}
+				break;
+			}
+		}
+	}
+}
+
+#else
+// Sends one block with the stop-and-wait handshake of the Marklin
+// bootloader, where only the data frames go out back to back
+boolean TrackController::uploadBlock(byte command, uint32_t uid, uint32_t size, void (*reader)(uint32_t offset, byte *buffer, byte length), byte number, word timeout)
+{
+	TrackMessage message;
+
+	uint32_t offset = (uint32_t)number * 64;
+	byte length = size - offset < 64 ? size - offset : 64;
+
+	message.clear();
+	message.command = command;
+	message.length = 0x06;
+	message.data[0] = uid >> 24;
+	message.data[1] = uid >> 16;
+	message.data[2] = uid >> 8;
+	message.data[3] = uid;
+	message.data[4] = 0x44;
+	message.data[5] = number;
+
+	if (!exchangeMessage(message, message, timeout) || message.data[4] != 0x44)
+	{
+		return false;
+	}
+
+	word crc = 0xffff;
+
+	// The hash numbers the data frames within the block
+	for (int i = 0; i < length; i += 8)
+	{
+		byte chunk = length - i < 8 ? length - i : 8;
+
+		message.clear();
+		message.command = command;
+		message.hash = 0x0300 + i / 8;
+		message.length = 0x08;
+
+		reader(offset + i, message.data, chunk);
+		for (int j = 0; j < chunk; j++)
+		{
+			crc = crc16(crc, message.data[j]);
+		}
+
+		if (writeCanMessage(*mCAN, message))
+		{
+			countFrame(message.length, true);
+		}
+	}
+
+	message.clear();
+	message.command = command;
+	message.length = 0x07;
+	message.data[0] = uid >> 24;
+	message.data[1] = uid >> 16;
+	message.data[2] = uid >> 8;
+	message.data[3] = uid;
+	message.data[4] = 0x88;
+	message.data[5] = highByte(crc);
+	message.data[6] = lowByte(crc);
+
+	// The device answers with the CRC it got, or with 0xF1 on errors
+	return exchangeMessage(message, message, timeout) && message.length >= 7 && message.data[4] == 0x88 && word(message.data[5], message.data[6]) == crc;
+}
+#endif
+
+boolean TrackController::upload(byte command, uint32_t uid, uint32_t size, void (*reader)(uint32_t offset, byte *buffer, byte length), word timeout)
+{
+	flushBus();
+
+	// Config data is a plain stream: a header holding the size and
+	// the CRC, followed by the data, none of which gets answered
+	if (command == 0x21)
+	{
+		TrackMessage message;
+		byte buffer[8];
+		word crc = 0xffff;
+
+		for (uint32_t offset = 0; offset < size; offset += 8)
+		{
+			byte length = size - offset < 8 ? size - offset : 8;
+
+			reader(offset, buffer, length);
+			for (int i = 0; i < length; i++)
+			{
+				crc = crc16(crc, buffer[i]);
+			}
+		}
+
+		message.clear();
+		message.command = command;
+		message.length = 0x06;
+		message.data[0] = size >> 24;
+		message.data[1] = size >> 16;
+		message.data[2] = size >> 8;
+		message.data[3] = size;
+		message.data[4] = highByte(crc);
+		message.data[5] = lowByte(crc);
+
+		if (!sendMessage(message))
+		{
+			return false;
+		}
+
+		for (uint32_t offset = 0; offset < size; offset += 8)
+		{
+			message.clear();
+			message.command = command;
+			message.length = 0x08;
+
+			reader(offset, message.data, size - offset < 8 ? size - offset : 8);
+
+			if (!sendMessage(message))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	uint32_t blocks = (size + 63) / 64;
+
+#if RAILUINO_UPLOAD_WINDOW
+	// Block numbers have 16 bits
+	if (blocks > 0x10000UL)
+	{
+		return false;
+	}
+
+	Upload upload = {};
+	upload.command = command;
+	upload.uid = uid;
+	upload.size = size;
+	upload.reader = reader;
+
+	uint32_t next = 0;
+
+	while (upload.acked < blocks)
+	{
+		receiveAcks(upload);
+
+		// Retransmissions go first, then new blocks fill the window
+		int index = -1;
+		for (int i = 0; i < RAILUINO_UPLOAD_WINDOW; i++)
+		{
+			if (upload.blocks[i].state == BLOCK_RESEND || (upload.blocks[i].state == BLOCK_SENT && millis() - upload.blocks[i].time >= timeout))
+			{
+				index = i;
+				break;
+			}
+		}
+
+		if (index >= 0)
+		{
+			if (upload.blocks[index].tries > RAILUINO_UPLOAD_RETRIES)
+			{
+				if (mDebug)
+				{
+					SERIAL_PORT_MONITOR.println(F("!!! Upload failed"));
+				}
+				return false;
+			}
+
+			mUploadRetransmits++;
+			sendBlock(upload, index);
+			continue;
+		}
+
+		for (int i = 0; i < RAILUINO_UPLOAD_WINDOW && next < blocks; i++)
+		{
+			if (upload.blocks[i].state == BLOCK_FREE)
+			{
+				upload.blocks[i].number = next++;
+				upload.blocks[i].tries = 0;
+				sendBlock(upload, i);
+				break;
+			}
+		}
+	}
+#else
+	// Block numbers have 8 bits
+	if (blocks > 0x100UL)
+	{
+		return false;
+	}
+
+	for (uint32_t number = 0; number < blocks; number++)
+	{
+		byte tries = 0;
+
+		while (!uploadBlock(command, uid, size, reader, number, timeout))
+		{
+			if (tries++ >= RAILUINO_UPLOAD_RETRIES)
+			{
+				if (mDebug)
+				{
+					SERIAL_PORT_MONITOR.println(F("!!! Upload failed"));
+				}
+				return false;
+			}
+
+			mUploadRetransmits++;
+		}
+	}
+#endif
+
+	return true;
+}
+
+word TrackController::getUploadRetransmits()
+{
+	return mUploadRetransmits;
+}
+
+void saveByte(int &at, word &crc, byte value)
+{
+	EEPROM.update(at++, value);
+	crc = crc16(crc, value);
+}
+
+byte loadByte(int &at, word &crc)
+{
+	byte value = EEPROM.read(at++);
+	crc = crc16(crc, value);
+	return value;
+}
+
+int TrackController::saveState(int base)
+{
+	int at = base;
+	word crc = 0xffff;
+	const LocoState noLoco = {};
+	const AccessoryState noAccessory = {};
+
+	saveByte(at, crc, 'R');
+	saveByte(at, crc, 'S');
+	saveByte(at, crc, STATE_VERSION);
+	saveByte(at, crc, RAILUINO_LOCO_STATES);
+	saveByte(at, crc, RAILUINO_ACC_STATES);
+
+	for (int i = 0; i < RAILUINO_LOCO_STATES; i++)
+	{
+		// Unused entries are saved as all zeroes
+		const LocoState *loco = mLocos[i].address != 0 ? &mLocos[i] : &noLoco;
+
+		saveByte(at, crc, highByte(loco->address));
+		saveByte(at, crc, lowByte(loco->address));
+		saveByte(at, crc, highByte(loco->speed));
+		saveByte(at, crc, lowByte(loco->speed));
+		saveByte(at, crc, loco->direction);
+		saveByte(at, crc, loco->flags);
+
+		for (int j = 24; j >= 0; j -= 8)
+		{
+			saveByte(at, crc, loco->functions >> j);
+		}
+
+		for (int j = 24; j >= 0; j -= 8)
+		{
+			saveByte(at, crc, loco->known >> j);
+		}
+	}
+
+	for (int i = 0; i < RAILUINO_ACC_STATES; i++)
+	{
+		const AccessoryState *accessory = mAccessories[i].address != 0 ? &mAccessories[i] : &noAccessory;
+
+		saveByte(at, crc, highByte(accessory->address));
+		saveByte(at, crc, lowByte(accessory->address));
+		saveByte(at, crc, accessory->position);
+		saveByte(at, crc, accessory->power);
+	}
+
+	EEPROM.update(at++, highByte(crc));
+	EEPROM.update(at++, lowByte(crc));
+
+	return at - base;
+}
+
+boolean TrackController::restoreState(int base)
+{
+	int at = base;
+	word crc = 0xffff;
+
+	// Validate everything before touching the tables
+	if (loadByte(at, crc) != 'R' || loadByte(at, crc) != 'S' || loadByte(at, crc) != STATE_VERSION || loadByte(at, crc) != RAILUINO_LOCO_STATES || loadByte(at, crc) != RAILUINO_ACC_STATES)
+	{
+		return false;
+	}
+
+	// Each locomotive takes 14 bytes, each accessory 4
+	for (int i = 0; i < RAILUINO_LOCO_STATES * 14 + RAILUINO_ACC_STATES * 4; i++)
+	{
+		loadByte(at, crc);
+	}
+
+	if (word(EEPROM.read(at), EEPROM.read(at + 1)) != crc)
+	{
+		return false;
+	}
+
+	// Old enough to be stale for any practical resync interval or
+	// time to live (about 12 days), yet far enough below 2^31 that
+	// the wrapping stamp comparisons in findLoco() and findAccessory()
+	// still see it as older than anything stamped later
+	unsigned long stamp = millis() - 0x40000000;
+
+	at = base + 5;
+
+	for (int i = 0; i < RAILUINO_LOCO_STATES; i++)
+	{
+		LocoState *loco = &mLocos[i];
+
+		loco->address = word(EEPROM.read(at), EEPROM.read(at + 1));
+		loco->speed = word(EEPROM.read(at + 2), EEPROM.read(at + 3));
+		loco->direction = EEPROM.read(at + 4);
+		loco->flags = EEPROM.read(at + 5);
+		loco->functions = 0;
+		loco->known = 0;
+		for (int j = 0; j < 4; j++)
+		{
+			loco->functions = loco->functions << 8 | EEPROM.read(at + 6 + j);
+			loco->known = loco->known << 8 | EEPROM.read(at + 10 + j);
+		}
+		loco->stamp = stamp;
+		loco->functionStamp = stamp;
+
+		at += 14;
+	}
+
+	for (int i = 0; i < RAILUINO_ACC_STATES; i++)
+	{
+		AccessoryState *accessory = &mAccessories[i];
+
+		accessory->address = word(EEPROM.read(at), EEPROM.read(at + 1));
+		accessory->position = EEPROM.read(at + 2);
+		accessory->power = EEPROM.read(at + 3);
+		accessory->stamp = stamp;
+
+		at += 4;
+	}
+
+	return true;
+}
+
+void TrackController::countFrame(byte length, boolean sent)
+{
+#if RAILUINO_METRICS
+	if (sent)
+	{
+		mMetrics.sent++;
+	}
+	else
+	{
+		mMetrics.received++;
+	}
+	// Extended frame without bit stuffing, including interframe space
+	mMetrics.bits += 67 + 8 * length;
+#else
+	(void)length;
+	(void)sent;
+#endif
+}
+
+// Counts a response to the given command that matched after 'rtt' us
+void TrackController::countResponse(byte command, unsigned long rtt)
+{
+#if RAILUINO_METRICS
+	static const unsigned long limits[7] = {1000, 2000, 5000, 10000, 20000, 50000, 100000};
+
+	byte bucket = 0;
+	while (bucket < 7 && rtt > limits[bucket])
+	{
+		bucket++;
+	}
+
+	mMetrics.exchanges[command < RAILUINO_METRIC_COMMANDS ? command : RAILUINO_METRIC_COMMANDS]++;
+	mMetrics.matched++;
+	mMetrics.buckets[bucket]++;
+	mMetrics.rttSum += rtt;
+#else
+	(void)command;
+	(void)rtt;
+#endif
+}
+
+// Counts a message skipped while waiting for a response
+void TrackController::countSkipped()
+{
+#if RAILUINO_METRICS
+	mMetrics.skipped++;
+#endif
+}
+
+// Counts an exchange of the given command that timed out
+void TrackController::countTimeout(byte command)
+{
+#if RAILUINO_METRICS
+	byte index = command < RAILUINO_METRIC_COMMANDS ? command : RAILUINO_METRIC_COMMANDS;
+
+	mMetrics.exchanges[index]++;
+	mMetrics.timeouts[index]++;
+#else
+	(void)command;
+#endif
+}
+
+#if RAILUINO_METRICS
+size_t printMetric(Print &p, const char *name, const char *type, unsigned long value)
+{
+	size_t size = 0;
+
+	size += p.print("# TYPE railuino_");
+	size += p.print(name);
+	size += p.print(" ");
+	size += p.println(type);
+	size += p.print("railuino_");
+	size += p.print(name);
+	size += p.print(" ");
+	size += p.println(value);
+
+	return size;
+}
+
+size_t printCommandMetric(Print &p, const char *name, const word *values)
+{
+	size_t size = 0;
+
+	size += p.print("# TYPE railuino_");
+	size += p.print(name);
+	size += p.println(" counter");
+
+	for (int i = 0; i <= RAILUINO_METRIC_COMMANDS; i++)
+	{
+		size += p.print("railuino_");
+		size += p.print(name);
+		size += p.print(i < RAILUINO_METRIC_COMMANDS ? "{command=\"" : "{command=\"other");
+		if (i < RAILUINO_METRIC_COMMANDS)
+		{
+			size += printHex(p, i, 2);
+		}
+		size += p.print("\"} ");
+		size += p.println(values[i]);
+	}
+
+	return size;
+}
+#endif
+
+size_t TrackController::printMetrics(Print &p)
+{
+	size_t size = 0;
+
+#if RAILUINO_METRICS
+	static const char *const limits[8] = {"0.001", "0.002", "0.005", "0.01", "0.02", "0.05", "0.1", "+Inf"};
+
+	const Metrics &metrics = mMetrics;
+
+	size += printMetric(p, "frames_sent_total", "counter", metrics.sent);
+	size += printMetric(p, "frames_received_total", "counter", metrics.received);
+	size += printMetric(p, "bus_bits_total", "counter", metrics.bits);
+	size += printMetric(p, "frames_skipped_total", "counter", metrics.skipped);
+	size += printMetric(p, "responses_matched_total", "counter", metrics.matched);
+	size += printMetric(p, "pulses_high_water", "gauge", mPulsePool.highWater());
+	size += printMetric(p, "pulses_exhausted_total", "counter", mPulsePool.exhausted());
+	size += printCommandMetric(p, "exchanges_total", metrics.exchanges);
+	size += printCommandMetric(p, "timeouts_total", metrics.timeouts);
+
+	size += p.println("# TYPE railuino_rtt_seconds histogram");
+
+	unsigned long count = 0;
+	for (int i = 0; i < 8; i++)
+	{
+		count += metrics.buckets[i];
+		size += p.print("railuino_rtt_seconds_bucket{le=\"");
+		size += p.print(limits[i]);
+		size += p.print("\"} ");
+		size += p.println(count);
+	}
+
+	size += p.print("railuino_rtt_seconds_sum ");
+	size += p.print(metrics.rttSum / 1000000);
+	size += p.print(".");
+	unsigned long fraction = metrics.rttSum % 1000000;
+	for (unsigned long digit = 100000; digit > fraction && digit > 1; digit /= 10)
+	{
+		size += p.print("0");
+	}
+	size += p.println(fraction);
+	size += p.print("railuino_rtt_seconds_count ");
+	size += p.println(count);
+#else
+	(void)p;
+#endif
+
+	return size;
+}
+
+#if RAILUINO_REFLEXES
+boolean TrackController::addReflex(word device, word contact, byte edge, TrackMessage &message)
+{
+	if (mReflexCount == RAILUINO_REFLEXES)
+	{
+		return false;
+	}
+
+	Reflex *reflex = &mReflexes[mReflexCount++];
+
+	reflex->device = device;
+	reflex->contact = contact;
+	reflex->edge = edge;
+	reflex->command = message.command;
+	reflex->length = message.length;
+	memcpy(reflex->data, message.data, sizeof(reflex->data));
+
+	return true;
+}
+
+void TrackController::clearReflexes()
+{
+	mReflexCount = 0;
+}
+#endif
+
+void TrackController::setOverloadHalt(boolean enabled)
+{
+	mOverloadHalt = enabled;
+}
+
+void TrackController::setOverloadHandler(void (*handler)(uint32_t uid, byte channel))
+{
+	mOverloadHandler = handler;
+}
+
+#if RAILUINO_OVERLOAD_DEVICES
+boolean TrackController::getOverload(uint32_t uid, byte *channels)
+{
+	byte result = 0;
+
+	for (int i = 0; i < RAILUINO_OVERLOAD_DEVICES; i++)
+	{
+		if (uid == 0 || mOverloads[i].uid == uid)
+		{
+			result |= mOverloads[i].channels;
+		}
+	}
+
+	*channels = result;
+
+	return result != 0;
+}
+#endif
+
+word TrackController::getOverloadCount()
+{
+	return mOverloadCount;
+}
+
+#if RAILUINO_OVERLOAD_DEVICES
+void TrackController::clearOverload()
+{
+	for (int i = 0; i < RAILUINO_OVERLOAD_DEVICES; i++)
+	{
+		mOverloads[i].channels = 0;
+	}
+}
+#endif
+
+void TrackController::setLinkMonitor(uint32_t uid, word interval, byte misses)
+{
+	mLinkUid = uid;
+	mLinkInterval = interval;
+	mLinkThreshold = misses;
+	mLinkMisses = 0;
+	mLinkUp = true;
+	mPingPending = false;
+	mPingTime = millis() - interval;
+}
+
+void TrackController::setLinkHandler(void (*handler)(boolean up))
+{
+	mLinkHandler = handler;
+}
+
+boolean TrackController::isLinkUp()
+{
+	return mLinkUp;
+}
+
+unsigned long TrackController::getLinkRtt()
+{
+	return mLinkRtt;
+}
+
+word TrackController::getLinkLoss()
+{
+	return mLinkLoss;
+}
+
+boolean TrackController::exchangeMessage(TrackMessage &out, TrackMessage &in, word timeout)
+{
+	int command = out.command;
+	boolean overload = isOverload(out);
+
+	// Target 0 addresses the whole system, which is never blocked,
+	// and neither are stop commands, whatever their target
+	uint32_t target = mBreakerThreshold != 0 && !isStop(out) ? targetOf(out) : 0;
+
+	if (target != 0 && !isReachable(target))
+	{
+		if (mDebug)
+		{
+			SERIAL_PORT_MONITOR.println(F("!!! Target unreachable"));
+		}
+
+		return false;
+	}
+
+	// Older messages, perhaps responses to other controllers on the
+	// same bus, must not be taken for the response
+	flushBus();
+
+	if (!sendMessage(out))
+	{
+		if (true)
+		{
+			if (mDebug)
+			{
+				SERIAL_PORT_MONITOR.println(F("!!! Send error"));
+				SERIAL_PORT_MONITOR.println(F("!!! Emergency stop"));
+			}
+			for (;;)
+				;
+		}
+	}
+
+	// Still send while the link is down, which may be wrong, so
+	// that stop commands always get out, but don't wait in vain
+	if (!mLinkUp)
+	{
+		if (mDebug)
+		{
+			SERIAL_PORT_MONITOR.println(F("!!! Link down"));
+		}
+
+		return false;
+	}
+
+	// Keep a copy for resending after a failover, 'in' may be 'out'
+	TrackMessage request = out;
+	word failovers = mFailovers;
+	unsigned long sent = micros();
+
+	ulong time = millis();
+	while (millis() - time < timeout)
+	{
+		if (failovers != mFailovers)
+		{
+			failovers = mFailovers;
+			sendMessage(request);
+		}
+
+		in.clear();
+		boolean result = receiveMessage(in);
+
+		// An overload report is never the response to anything else
+		if (result && in.command == command && in.response && (!isOverload(in) || overload))
+		{
+			countResponse(command, micros() - sent);
+
+			if (target != 0)
+			{
+				Breaker *breaker = findBreaker(target, false);
+				if (breaker != nullptr)
+				{
+					breaker->failures = 0;
+				}
+			}
+
+			return true;
+		}
+
+		if (result)
+		{
+			countSkipped();
+		}
+	}
+
+	if (mDebug)
+	{
+		SERIAL_PORT_MONITOR.println(F("!!! Receive timeout"));
+	}
+
+	countTimeout(command);
+
+	if (target != 0)
+	{
+		Breaker *breaker = findBreaker(target, true);
+		if (breaker->failures < 255)
+		{
+			breaker->failures++;
+		}
+
+		if (breaker->failures >= mBreakerThreshold)
+		{
+			breaker->until = millis() + mBreakerBackoff;
+		}
+	}
+
+	return false;
+}
+
+boolean TrackController::setPower(boolean power)
+{
+	TrackMessage message;
+
+	if (power)
+	{
+		message.clear();
+		message.command = 0x00;
+		message.length = 0x07;
+		message.data[4] = 9;
+		message.data[6] = 0xD;
+
+		exchangeMessage(message, message, 1000);
+
+		message.clear();
+		message.command = 0x00;
+		message.length = 0x06;
+		message.data[4] = 8;
+		message.data[5] = 7;
+
+		exchangeMessage(message, message, 1000);
+	}
+
+	message.clear();
+	message.command = 0x00;
+	message.length = 0x05;
+	message.data[4] = power ? 0x01 : 0x00;
+
+	return exchangeMessage(message, message, 1000);
+}
+
+boolean TrackController::setPower2(boolean power)
+{
+	TrackMessage message;
+
+	message.clear();
+	message.command = 0x00;
+	message.length = 0x05;
+	message.data[4] = power ? 0x01 : 0x00;
+
+	return sendMessage(message);
+}
+
+boolean TrackController::getPower(boolean *power)
+{
+	TrackMessage message;
+
+	message.clear();
+	message.command = 0x00;
+	message.length = 0x04;
+
+	if (exchangeMessage(message, message, 1000))
+	{
+		*power = message.data[4];
+		return true;
+	}
+	else
+	{
+		return false;
+	}
+}
+
+boolean TrackController::getPower2(void)
+{
+	TrackMessage message;
+
+	message.clear();
+	message.command = 0x00;
+	message.length = 0x04;
+
+	return sendMessage(message);
+}
+
+boolean TrackController::setLocoDirection(word address, byte direction)
+{
+	if (mElision && direction != DIR_CHANGE)
+	{
+		// Setting the direction also stops the locomotive, so only a
+		// standing one already has what was asked for
+		LocoState *loco = findLoco(address, false);
+		if (loco != nullptr && (loco->flags & LOCO_DIRECTION) && loco->direction == direction && (loco->flags & LOCO_SPEED) && loco->speed == 0 && isFresh(loco->stamp))
+		{
+			return true;
+		}
+	}
+
+	TrackMessage message;
+
+	message.clear();
+	message.command = 0x00;
+	message.length = 0x05;
+	message.data[2] = highByte(address);
+	message.data[3] = lowByte(address);
+	message.data[4] = 0x03;
+
+	exchangeMessage(message, message, 1000);
+
+	message.clear();
+	message.command = 0x05;
+	message.length = 0x05;
+	message.data[2] = highByte(address);
+	message.data[3] = lowByte(address);
+	message.data[4] = direction;
+
+	return exchangeMessage(message, message, 1000);
+}
+
+boolean TrackController::toggleLocoDirection(word address)
+{
+	return setLocoDirection(address, DIR_CHANGE);
+}
+
+boolean TrackController::setLocoSpeed(word address, word speed)
+{
+	if (mElision || mQuantise)
+	{
+		LocoState *loco = findLoco(address, false);
+		if (loco != nullptr && (loco->flags & LOCO_SPEED) && isFresh(loco->stamp))
+		{
+			if (mElision && loco->speed == speed)
+			{
+				return true;
+			}
+
+			if (mQuantise && speedStep(address, loco->speed) == speedStep(address, speed))
+			{
+				return true;
+			}
+		}
+	}
+
+	TrackMessage message;
+
+	message.clear();
+	message.command = 0x04;
+	message.length = 0x06;
+	message.data[2] = highByte(address);
+	message.data[3] = lowByte(address);
+	message.data[4] = highByte(speed);
+	message.data[5] = lowByte(speed);
+
+	return exchangeMessage(message, message, 1000);
+}
+
+boolean TrackController::accelerateLoco(word address)
+{
+	word speed;
+
+	if (getLocoSpeed(address, &speed))
+	{
+		speed += 77;
+		if (speed > 1023)
+		{
+			speed = 1023;
+		}
+
+		return setLocoSpeed(address, speed);
+	}
+
+	return false;
+}
+
+boolean TrackController::decelerateLoco(word address)
+{
+	word speed;
+
+	if (getLocoSpeed(address, &speed))
+	{
+		speed -= 77;
+		if (speed > 32767)
+		{
+			speed = 0;
+		}
+
+		return setLocoSpeed(address, speed);
+	}
+
+	return false;
+}
+
+boolean TrackController::setLocoFunction(word address, byte function, byte power)
+{
+	// Only "off" and "on" can be compared with what the bus reports
+	if (mElision && function < 32 && power <= 1)
+	{
+		LocoState *loco = findLoco(address, false);
+		uint32_t mask = (uint32_t)1 << function;
+		if (loco != nullptr && (loco->known & mask) && ((loco->functions & mask) != 0) == (power != 0) && isFresh(loco->functionStamp))
+		{
+			return true;
+		}
+	}
+
+	TrackMessage message;
+
+	message.clear();
+	message.command = 0x06;
+	message.length = 0x06;
+	message.data[2] = highByte(address);
+	message.data[3] = lowByte(address);
+	message.data[4] = function;
 	message.data[5] = power;
 
 	return exchangeMessage(message, message, 1000);
@@ -438,6 +2413,15 @@ boolean TrackController::toggleLocoFunction(word address, byte function)
 boolean TrackController::setAccessory(word address, byte position, byte power,
 									  word time)
 {
+	if (mElision && time == 0)
+	{
+		AccessoryState *accessory = findAccessory(address, false);
+		if (accessory != nullptr && accessory->position == position && accessory->power == power && isFresh(accessory->stamp))
+		{
+			return true;
+		}
+	}
+
 	TrackMessage message;
 
 	message.clear();
@@ -467,6 +2451,25 @@ boolean TrackController::setAccessory(word address, byte position, byte power,
 	return true;
 }
 
+// Switches off accessories whose pulse is over
+void TrackController::releasePulses()
+{
+	for (Pulse *pulse = mPulses.first(); pulse != nullptr;)
+	{
+		Pulse *next = pulse->next;
+
+		if ((long)(millis() - pulse->due) >= 0)
+		{
+			setAccessory2(pulse->address, pulse->position, 0, 0);
+
+			mPulses.remove(pulse);
+			mPulsePool.release(pulse);
+		}
+
+		pulse = next;
+	}
+}
+
 boolean TrackController::setAccessory2(word address, byte position, byte power,
 									   word time)
 {
@@ -482,6 +2485,28 @@ boolean TrackController::setAccessory2(word address, byte position, byte power,
 
 	sendMessage(message);
 
+	if (time != 0)
+	{
+		// Sketches that rarely call update() still get their slots back
+		releasePulses();
+
+		Pulse *pulse = mPulsePool.allocate();
+
+		if (pulse != nullptr)
+		{
+			pulse->address = address;
+			pulse->position = position;
+			pulse->due = millis() + time;
+			mPulses.push(pulse);
+		}
+		else
+		{
+			// Never leave an accessory powered for too long
+			delay(time);
+			setAccessory2(address, position, 0, 0);
+		}
+	}
+
 	return true;
 }
 
@@ -492,6 +2517,13 @@ boolean TrackController::setTurnout(word address, boolean straight)
 
 boolean TrackController::getLocoDirection(word address, byte *direction)
 {
+	LocoState *loco = findCachedLoco(address, false);
+	if (loco != nullptr && (loco->flags & LOCO_DIRECTION))
+	{
+		direction[0] = loco->direction;
+		return true;
+	}
+
 	TrackMessage message;
 
 	message.clear();
@@ -513,6 +2545,13 @@ boolean TrackController::getLocoDirection(word address, byte *direction)
 
 boolean TrackController::getLocoSpeed(word address, word *speed)
 {
+	LocoState *loco = findCachedLoco(address, false);
+	if (loco != nullptr && (loco->flags & LOCO_SPEED))
+	{
+		speed[0] = loco->speed;
+		return true;
+	}
+
 	TrackMessage message;
 
 	message.clear();
@@ -532,31 +2571,198 @@ boolean TrackController::getLocoSpeed(word address, word *speed)
 	}
 }
 
-boolean TrackController::getLocoFunction(word address, byte function,
-										 byte *power)
+boolean TrackController::getLocoFunction(word address, byte function,
+										 byte *power)
+{
+	LocoState *loco = function < 32 ? findCachedLoco(address, true) : nullptr;
+	if (loco != nullptr && bitRead(loco->known, function))
+	{
+		power[0] = bitRead(loco->functions, function);
+		return true;
+	}
+
+	TrackMessage message;
+
+	message.clear();
+	message.command = 0x06;
+	message.length = 0x05;
+	message.data[2] = highByte(address);
+	message.data[3] = lowByte(address);
+	message.data[4] = function;
+
+	if (exchangeMessage(message, message, 1000))
+	{
+		power[0] = message.data[5];
+		return true;
+	}
+	else
+	{
+		return false;
+	}
+}
+
+// Sends 'count' messages obtained from 'build' back to back, which
+// may decline to build some, and waits until 'match' has accepted a
+// response for each of those sent, or until there was none for
+// 'timeout' ms. Returns whether all were sent and answered.
+boolean TrackController::pipeline(byte count, word timeout, void *context, boolean (*build)(void *context, byte index, TrackMessage &message), boolean (*match)(void *context, TrackMessage &message))
+{
+	TrackMessage message;
+	byte pending = count;
+	byte next = 0;
+	boolean failed = false;
+
+	flushBus();
+
+	ulong time = millis();
+	while (pending != 0 && millis() - time < timeout)
+	{
+		// Drain between sends so the receive buffers never overflow
+		while (receiveMessage(message))
+		{
+			if (message.response && match(context, message))
+			{
+				pending--;
+			}
+		}
+
+		if (next < count)
+		{
+			if (!build(context, next++, message))
+			{
+				pending--;
+				continue;
+			}
+
+			if (!sendMessage(message))
+			{
+				pending--;
+				failed = true;
+			}
+
+			time = millis();
+		}
+	}
+
+	if (pending != 0 && mDebug)
+	{
+		SERIAL_PORT_MONITOR.println(F("!!! Receive timeout"));
+	}
+
+	return pending == 0 && !failed;
+}
+
+struct FunctionExchange
+{
+	word address;
+	uint32_t pending;
+	uint32_t requested;
+	uint32_t values;
+	boolean set;
+};
+
+boolean buildFunction(void *context, byte function, TrackMessage &message)
+{
+	FunctionExchange *exchange = (FunctionExchange *)context;
+
+	if (!(exchange->pending & ((uint32_t)1 << function)))
+	{
+		return false;
+	}
+
+	message.clear();
+	message.command = 0x06;
+	message.length = exchange->set ? 0x06 : 0x05;
+	message.data[2] = highByte(exchange->address);
+	message.data[3] = lowByte(exchange->address);
+	message.data[4] = function;
+	message.data[5] = bitRead(exchange->requested, function);
+
+	return true;
+}
+
+boolean matchFunction(void *context, TrackMessage &message)
+{
+	FunctionExchange *exchange = (FunctionExchange *)context;
+
+	if (message.command != 0x06 || message.length != 6 || message.data[4] >= 32 || word(message.data[2], message.data[3]) != exchange->address)
+	{
+		return false;
+	}
+
+	uint32_t flag = (uint32_t)1 << message.data[4];
+	if (message.data[5] != 0)
+	{
+		exchange->values |= flag;
+	}
+	else
+	{
+		exchange->values &= ~flag;
+	}
+
+	if (!(exchange->pending & flag))
+	{
+		return false;
+	}
+
+	exchange->pending &= ~flag;
+	return true;
+}
+
+boolean TrackController::exchangeFunctions(word address, uint32_t mask, uint32_t *functions, boolean set)
+{
+	if (mBreakerThreshold != 0 && !isReachable(address))
+	{
+		return false;
+	}
+
+	FunctionExchange exchange = {address, mask, *functions, *functions, set};
+
+	boolean result = pipeline(32, 1000, &exchange, buildFunction, matchFunction);
+
+	*functions = exchange.values;
+
+	return result;
+}
+
+boolean TrackController::getLocoFunctions(word address, uint32_t *functions)
 {
-	TrackMessage message;
+	*functions = 0;
 
-	message.clear();
-	message.command = 0x06;
-	message.length = 0x05;
-	message.data[2] = highByte(address);
-	message.data[3] = lowByte(address);
-	message.data[4] = function;
+	return exchangeFunctions(address, 0xffffffff, functions, false);
+}
 
-	if (exchangeMessage(message, message, 1000))
-	{
-		power[0] = message.data[5];
-		return true;
-	}
-	else
+boolean TrackController::setLocoFunctions(word address, uint32_t functions)
+{
+	uint32_t mask = 0xffffffff;
+
+	LocoState *loco = findLoco(address, false);
+	if (loco != nullptr && isFresh(loco->functionStamp))
 	{
-		return false;
+		mask = ~loco->known | (loco->functions ^ functions);
 	}
+
+	return exchangeFunctions(address, mask, &functions, true);
 }
 
 boolean TrackController::getAccessory(word address, byte *position, byte *power)
 {
+	if (mCachedReads)
+	{
+		AccessoryState *accessory = findAccessory(address, false);
+		if (accessory != nullptr && accessory->position != 0xff && (mTtl == 0 || millis() - accessory->stamp < mTtl))
+		{
+			if (accessory->reads < 255)
+			{
+				accessory->reads++;
+			}
+
+			position[0] = accessory->position;
+			power[0] = accessory->power;
+			return true;
+		}
+	}
+
 	TrackMessage message;
 
 	message.clear();
@@ -590,6 +2796,22 @@ boolean TrackController::getAccessory2(word address)
 	return sendMessage(message);
 }
 
+boolean TrackController::getTurnout(word address, boolean *straight)
+{
+	byte position;
+	byte power;
+
+	if (getAccessory(address, &position, &power))
+	{
+		straight[0] = position == ACC_STRAIGHT;
+		return true;
+	}
+	else
+	{
+		return false;
+	}
+}
+
 boolean TrackController::writeConfig(word address, word number, byte value)
 {
 	TrackMessage message;
@@ -680,3 +2902,393 @@ boolean TrackController::getSystemStatus(uint32_t uid, byte channel, word *statu
 
 	return true;
 }
+
+// ===================================================================
+// === TrackBus ======================================================
+// ===================================================================
+
+void TrackBus::init(MCP_CAN &aCAN)
+{
+	mCAN = &aCAN;
+}
+
+boolean TrackBus::attach(TrackController &controller)
+{
+	if (mCount == RAILUINO_BUS_CONTROLLERS)
+	{
+		return false;
+	}
+
+	Slot *slot = &mSlots[mCount++];
+
+	slot->controller = &controller;
+	slot->inbox.clear();
+
+	return true;
+}
+
+void TrackBus::update()
+{
+	TrackMessage message;
+	byte budget = RAILUINO_UPDATE_BUDGET;
+
+	while (budget-- > 0 && readCanMessage(*mCAN, message))
+	{
+		for (int i = 0; i < mCount; i++)
+		{
+			Slot *slot = &mSlots[i];
+
+			// Overwrite the oldest message of a controller that doesn't keep up
+			slot->inbox.overwrite(message);
+
+			slot->controller->observe(message);
+		}
+	}
+}
+
+boolean TrackBus::receive(TrackController &controller, TrackMessage &message)
+{
+	update();
+
+	for (int i = 0; i < mCount; i++)
+	{
+		Slot *slot = &mSlots[i];
+
+		if (slot->controller == &controller)
+		{
+			return slot->inbox.pop(message);
+		}
+	}
+
+	return false;
+}
+
+void TrackBus::flush(TrackController &controller)
+{
+	update();
+
+	for (int i = 0; i < mCount; i++)
+	{
+		if (mSlots[i].controller == &controller)
+		{
+			mSlots[i].inbox.clear();
+		}
+	}
+}
+
+// ===================================================================
+// === TrackBridge ===================================================
+// ===================================================================
+
+void TrackBridge::init(MCP_CAN &aSegmentA, MCP_CAN &aSegmentB, const TrackRoute *routes, byte count)
+{
+	mSegments[0] = &aSegmentA;
+	mSegments[1] = &aSegmentB;
+	mRoutes = routes;
+	mRouteCount = count;
+
+	for (int i = 0; i < RAILUINO_BRIDGE_PENDING; i++)
+	{
+		mPending[i].from = 0xff;
+	}
+}
+
+void TrackBridge::update()
+{
+	TrackMessage message;
+
+	for (byte from = 0; from < 2; from++)
+	{
+		byte budget = RAILUINO_UPDATE_BUDGET;
+
+		while (budget-- > 0 && readCanMessage(*mSegments[from], message))
+		{
+			forward(from, message);
+		}
+	}
+}
+
+void TrackBridge::forward(byte from, TrackMessage &message)
+{
+	byte to = 1 - from;
+	word address = word(message.data[2], message.data[3]);
+
+	if (message.response)
+	{
+		// Route back to where the request came from
+		for (int i = 0; i < RAILUINO_BRIDGE_PENDING; i++)
+		{
+			Pending *pending = &mPending[i];
+
+			if (pending->from == to && pending->command == message.command && (pending->hash == message.hash || pending->address == address) && millis() - pending->time < RAILUINO_BRIDGE_TIMEOUT)
+			{
+				if (writeCanMessage(*mSegments[to], message))
+				{
+					mForwarded++;
+				}
+				return;
+			}
+		}
+	}
+	else
+	{
+		byte direction = from == 0 ? ROUTE_A_TO_B : ROUTE_B_TO_A;
+
+		for (int i = 0; i < mRouteCount; i++)
+		{
+			const TrackRoute *route = &mRoutes[i];
+
+			if (route->command == message.command && (route->directions & direction) && address >= route->first && address <= route->last)
+			{
+				// Remember the request, replacing the oldest one
+				Pending *pending = &mPending[0];
+				for (int j = 1; j < RAILUINO_BRIDGE_PENDING; j++)
+				{
+					if ((long)(mPending[j].time - pending->time) < 0)
+					{
+						pending = &mPending[j];
+					}
+				}
+
+				pending->hash = message.hash;
+				pending->address = address;
+				pending->command = message.command;
+				pending->from = from;
+				pending->time = millis();
+
+				if (writeCanMessage(*mSegments[to], message))
+				{
+					mForwarded++;
+				}
+				return;
+			}
+		}
+	}
+
+	mFiltered++;
+}
+
+unsigned long TrackBridge::getForwarded()
+{
+	return mForwarded;
+}
+
+unsigned long TrackBridge::getFiltered()
+{
+	return mFiltered;
+}
+
+// ===================================================================
+// === TrackBatch ====================================================
+// ===================================================================
+
+boolean TrackBatch::add(byte command, byte length, word address, byte data0, byte data1)
+{
+	if (mCount == RAILUINO_BATCH)
+	{
+		return false;
+	}
+
+	Operation *operation = &mOperations[mCount++];
+
+	operation->command = command;
+	operation->length = length;
+	operation->address = address;
+	operation->data[0] = data0;
+	operation->data[1] = data1;
+	operation->flags = 0;
+
+	return true;
+}
+
+boolean TrackBatch::setLocoSpeed(word address, word speed)
+{
+	return add(0x04, 0x06, address, highByte(speed), lowByte(speed));
+}
+
+boolean TrackBatch::setLocoDirection(word address, byte direction)
+{
+	return add(0x05, 0x05, address, direction, 0);
+}
+
+boolean TrackBatch::setLocoFunction(word address, byte function, byte power)
+{
+	return add(0x06, 0x06, address, function, power);
+}
+
+boolean TrackBatch::setAccessory(word address, byte position, byte power)
+{
+	return add(0x0b, 0x06, address, position, power);
+}
+
+void TrackBatch::prepare(TrackController &controller, Operation *operation)
+{
+	operation->flags = 0;
+	operation->undo[0] = operation->data[0];
+	operation->undo[1] = operation->data[1];
+
+	// Fail right away what the circuit breaker holds back
+	if (controller.mBreakerThreshold != 0 && !controller.isReachable(operation->address))
+	{
+		operation->flags |= OP_BLOCKED;
+	}
+
+	// Remember the previous state, if known, for a rollback
+	if (operation->command == 0x0b)
+	{
+		TrackController::AccessoryState *accessory = controller.findAccessory(operation->address, false);
+		if (accessory != nullptr && accessory->position != 0xff)
+		{
+			operation->undo[0] = accessory->position;
+			operation->flags |= OP_UNDO;
+		}
+	}
+	else
+	{
+		TrackController::LocoState *loco = controller.findLoco(operation->address, false);
+		if (loco != nullptr)
+		{
+			if (operation->command == 0x04 && (loco->flags & TrackController::LOCO_SPEED))
+			{
+				operation->undo[0] = highByte(loco->speed);
+				operation->undo[1] = lowByte(loco->speed);
+				operation->flags |= OP_UNDO;
+			}
+			else if (operation->command == 0x05 && (loco->flags & TrackController::LOCO_DIRECTION))
+			{
+				operation->undo[0] = loco->direction;
+				operation->flags |= OP_UNDO;
+			}
+			else if (operation->command == 0x06 && operation->data[0] < 32 && bitRead(loco->known, operation->data[0]))
+			{
+				operation->undo[1] = bitRead(loco->functions, operation->data[0]);
+				operation->flags |= OP_UNDO;
+			}
+		}
+	}
+}
+
+void TrackBatch::toMessage(Operation *operation, const byte *data, TrackMessage &message)
+{
+	message.clear();
+	message.command = operation->command;
+	message.length = operation->length;
+	message.data[2] = highByte(operation->address);
+	message.data[3] = lowByte(operation->address);
+	message.data[4] = data[0];
+	message.data[5] = data[1];
+}
+
+boolean TrackBatch::build(void *context, byte index, TrackMessage &message)
+{
+	TrackBatch *batch = (TrackBatch *)context;
+	Operation *operation = &batch->mOperations[index];
+
+	if (operation->flags & OP_BLOCKED)
+	{
+		return false;
+	}
+
+	batch->toMessage(operation, operation->data, message);
+	operation->flags |= OP_SENT;
+
+	return true;
+}
+
+boolean TrackBatch::match(void *context, TrackMessage &message)
+{
+	TrackBatch *batch = (TrackBatch *)context;
+
+	for (byte i = 0; i < batch->mCount; i++)
+	{
+		Operation *operation = &batch->mOperations[i];
+
+		if ((operation->flags & OP_SENT) && !(operation->flags & OP_DONE) && message.command == operation->command && message.length >= 5 && word(message.data[2], message.data[3]) == operation->address && (operation->command != 0x06 || message.data[4] == operation->data[0]))
+		{
+			operation->flags |= OP_DONE;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+boolean TrackBatch::submit(TrackController &controller, word timeout, boolean rollback)
+{
+	TrackMessage message;
+
+	mFailures = 0;
+	mRolledBack = 0;
+
+	for (byte i = 0; i < mCount; i++)
+	{
+		prepare(controller, &mOperations[i]);
+	}
+
+	unsigned long start = micros();
+
+	controller.pipeline(mCount, timeout, this, build, match);
+
+	mLatency = micros() - start;
+
+	for (byte i = 0; i < mCount; i++)
+	{
+		if (!(mOperations[i].flags & OP_DONE))
+		{
+			mFailures++;
+		}
+	}
+
+	if (mFailures != 0 && rollback)
+	{
+		for (byte i = mCount; i-- > 0;)
+		{
+			Operation *operation = &mOperations[i];
+
+			if ((operation->flags & OP_DONE) && (operation->flags & OP_UNDO))
+			{
+				toMessage(operation, operation->undo, message);
+
+				if (controller.sendMessage(message))
+				{
+					mRolledBack++;
+				}
+			}
+		}
+	}
+
+	return mFailures == 0;
+}
+
+byte TrackBatch::size()
+{
+	return mCount;
+}
+
+boolean TrackBatch::getResult(byte index)
+{
+	return index < mCount && (mOperations[index].flags & OP_DONE);
+}
+
+byte TrackBatch::getFailures()
+{
+	return mFailures;
+}
+
+byte TrackBatch::getRolledBack()
+{
+	return mRolledBack;
+}
+
+unsigned long TrackBatch::getLatency()
+{
+	return mLatency;
+}
+
+void TrackBatch::clear()
+{
+	mCount = 0;
+	mFailures = 0;
+	mRolledBack = 0;
+	mLatency = 0;
+}
@@ -21,6 +21,7 @@
 
 #include <Arduino.h>
 #include <Printable.h>
+#include "RailuinoContainers.h"
 
 // ===================================================================
 // === Board detection ===============================================
@@ -46,6 +47,11 @@
 #define RAILUINO_VERSION 0x005A // 0.90
 #define TRACKBOX_VERSION 0x0127 // 1.39
 
+/**
+ * Version of the layout of the states saved to the EEPROM.
+ */
+#define STATE_VERSION 0x01
+
 /**
  * Constants for protocol base addresses.
  */
@@ -58,6 +64,44 @@
 #define ADDR_ACC_MM2 0x2FFF // MM2 magnetic accessory
 #define ADDR_ACC_DCC 0x3800 // DCC magnetic accessory
 
+/**
+ * Constants for the number of speed steps decoders of the different
+ * protocols support. DCC decoders may also run with 14 or 28 steps,
+ * so the finest setting is assumed unless configured otherwise.
+ */
+#define STEPS_MM2 14
+#define STEPS_SX1 31
+#define STEPS_MFX 126
+#define STEPS_SX2 127
+#ifndef STEPS_DCC
+#define STEPS_DCC 126
+#endif
+
+/**
+ * Returns the number of speed steps of the protocol the given
+ * locomotive address belongs to.
+ */
+constexpr byte speedSteps(word address)
+{
+  return address >= ADDR_DCC   ? STEPS_DCC
+         : address >= ADDR_SX2 ? STEPS_SX2
+         : address >= ADDR_MFX ? STEPS_MFX
+         : address >= ADDR_SX1 ? STEPS_SX1
+                               : STEPS_MM2;
+}
+
+/**
+ * Returns the decoder speed step a speed of 0 to 1023 results in
+ * for the given locomotive address. Any speed other than 0 results
+ * in at least step 1, anything from 1000 upwards in the top step.
+ */
+constexpr byte speedStep(word address, word speed)
+{
+  return speed == 0      ? 0
+         : speed >= 1000 ? speedSteps(address)
+                         : (byte)(((uint32_t)speed * speedSteps(address) + 999) / 1000);
+}
+
 /**
  * Constants for classic MM2 Delta addresses.
  */
@@ -95,6 +139,274 @@
 #define ACC_WHITE 3
 #define ACC_SH0 3
 
+/**
+ * Constants for contact edges of S88 feedback modules.
+ */
+#define EDGE_RISING 1  // Contact became occupied
+#define EDGE_FALLING 2 // Contact became free
+#define EDGE_BOTH 3
+
+/**
+ * Constants for the types of layout changes, which can be combined
+ * into filter masks.
+ */
+#define CHANGE_SPEED 0x01
+#define CHANGE_DIRECTION 0x02
+#define CHANGE_FUNCTION 0x04
+#define CHANGE_ACCESSORY 0x08
+#define CHANGE_SENSOR 0x10
+#define CHANGE_POWER 0x20
+#define CHANGE_ALL 0x3F
+
+/**
+ * Number of unresponsive targets (locomotives, accessories or
+ * devices) the circuit breaker can keep track of at the same time.
+ */
+#ifndef RAILUINO_BREAKER_TARGETS
+#if defined(__UNO__)
+#define RAILUINO_BREAKER_TARGETS 4
+#else
+#define RAILUINO_BREAKER_TARGETS 8
+#endif
+#endif
+
+/**
+ * Number of locomotives and magnetic accessories whose last known
+ * state the controller remembers. If more are used, the least
+ * recently updated entries are forgotten.
+ */
+#ifndef RAILUINO_LOCO_STATES
+#if defined(__UNO__)
+#define RAILUINO_LOCO_STATES 4
+#else
+#define RAILUINO_LOCO_STATES 8
+#endif
+#endif
+
+#ifndef RAILUINO_ACC_STATES
+#if defined(__UNO__)
+#define RAILUINO_ACC_STATES 8
+#else
+#define RAILUINO_ACC_STATES 32
+#endif
+#endif
+
+/**
+ * Number of devices (boosters or track format processors) whose
+ * overload state is tracked at the same time. 0 leaves out
+ * getOverload() and clearOverload().
+ */
+#ifndef RAILUINO_OVERLOAD_DEVICES
+#if defined(__UNO__)
+#define RAILUINO_OVERLOAD_DEVICES 2
+#else
+#define RAILUINO_OVERLOAD_DEVICES 4
+#endif
+#endif
+
+/**
+ * Time (in ms) the active CAN interface may stay silent while the
+ * standby interface keeps receiving before the controller fails over.
+ */
+#ifndef RAILUINO_FAILOVER_SILENCE
+#define RAILUINO_FAILOVER_SILENCE 100
+#endif
+
+/**
+ * Number of controllers that can share a TrackBus, and number of
+ * messages each of them can have waiting to be received.
+ */
+#ifndef RAILUINO_BUS_CONTROLLERS
+#if defined(__UNO__)
+#define RAILUINO_BUS_CONTROLLERS 2
+#define RAILUINO_BUS_INBOX 4
+#else
+#define RAILUINO_BUS_CONTROLLERS 4
+#define RAILUINO_BUS_INBOX 8
+#endif
+#endif
+
+/**
+ * Number of forwarded requests a TrackBridge remembers for routing
+ * the responses back, and the time (in ms) it waits for them.
+ */
+#ifndef RAILUINO_BRIDGE_PENDING
+#if defined(__UNO__)
+#define RAILUINO_BRIDGE_PENDING 4
+#else
+#define RAILUINO_BRIDGE_PENDING 8
+#endif
+#endif
+
+#ifndef RAILUINO_BRIDGE_TIMEOUT
+#define RAILUINO_BRIDGE_TIMEOUT 1000
+#endif
+
+/**
+ * Number of layout changes kept for subscribers, which must be a
+ * power of two. A subscriber that falls behind further than that
+ * loses the oldest changes. 0 leaves out subscriptions altogether.
+ */
+#ifndef RAILUINO_CHANGES
+#if defined(__UNO__)
+#define RAILUINO_CHANGES 8
+#else
+#define RAILUINO_CHANGES 32
+#endif
+#endif
+
+static_assert((RAILUINO_CHANGES & (RAILUINO_CHANGES - 1)) == 0, "RAILUINO_CHANGES must be a power of two");
+
+/**
+ * Whether the controller can serve the bus to a host (see serve()).
+ * The line buffer and the transmit queues take a few hundred bytes,
+ * which an Uno can hardly spare.
+ */
+#ifndef RAILUINO_GATEWAY
+#if defined(__UNO__)
+#define RAILUINO_GATEWAY 0
+#else
+#define RAILUINO_GATEWAY 1
+#endif
+#endif
+
+/**
+ * Maximum length of a line read by TrackController::serve(), which
+ * must hold a TrackMessage in the format of printTo().
+ */
+#ifndef RAILUINO_LINE
+#define RAILUINO_LINE 40
+#endif
+
+/**
+ * Whether the controller collects metrics (see printMetrics()), and
+ * for how many commands, starting at 0x00, it counts exchanges and
+ * timeouts separately. Higher commands are counted together.
+ */
+#ifndef RAILUINO_METRICS
+#if defined(__UNO__)
+#define RAILUINO_METRICS 0
+#else
+#define RAILUINO_METRICS 1
+#endif
+#endif
+
+#ifndef RAILUINO_METRIC_COMMANDS
+#define RAILUINO_METRIC_COMMANDS 12
+#endif
+
+/**
+ * Maximum number of messages a single call to update() (or serve())
+ * of a TrackController, TrackBus or TrackBridge processes per CAN
+ * interface. Keeps one busy interface from starving the others when
+ * a sketch services several of them from the same loop().
+ */
+#ifndef RAILUINO_UPDATE_BUDGET
+#define RAILUINO_UPDATE_BUDGET 8
+#endif
+
+/**
+ * Number of accessory pulses setAccessory2() can have running at the
+ * same time before it falls back to blocking.
+ */
+#ifndef RAILUINO_PULSES
+#if defined(__UNO__)
+#define RAILUINO_PULSES 4
+#else
+#define RAILUINO_PULSES 8
+#endif
+#endif
+
+/**
+ * Number of reflex rules that can be registered at the same time.
+ * 0 leaves out reflexes altogether.
+ */
+#ifndef RAILUINO_REFLEXES
+#if defined(__UNO__)
+#define RAILUINO_REFLEXES 4
+#else
+#define RAILUINO_REFLEXES 8
+#endif
+#endif
+
+/**
+ * Number of recently selected locomotives remembered for prefetching
+ * their neighbours, which is also the number of locomotives that can
+ * wait for being prefetched. 0 leaves out prefetching altogether.
+ */
+#ifndef RAILUINO_RECENT_LOCOS
+#if defined(__UNO__)
+#define RAILUINO_RECENT_LOCOS 4
+#else
+#define RAILUINO_RECENT_LOCOS 8
+#endif
+#endif
+
+/**
+ * Number of functions, starting with function 0, that prefetchLoco()
+ * queries for each locomotive.
+ */
+#ifndef RAILUINO_PREFETCH_FUNCTIONS
+#define RAILUINO_PREFETCH_FUNCTIONS 32
+#endif
+
+/**
+ * Number of hosts (distinguished by hash) whose messages serve()
+ * queues separately, and the number of messages each queue holds.
+ * Stop commands have a queue of the same size of their own.
+ */
+#ifndef RAILUINO_CLIENTS
+#if defined(__UNO__)
+#define RAILUINO_CLIENTS 2
+#else
+#define RAILUINO_CLIENTS 4
+#endif
+#endif
+
+#ifndef RAILUINO_CLIENT_QUEUE
+#if defined(__UNO__)
+#define RAILUINO_CLIENT_QUEUE 4
+#else
+#define RAILUINO_CLIENT_QUEUE 8
+#endif
+#endif
+
+/**
+ * Number of blocks upload() keeps in flight before it waits for
+ * their acknowledgements. 0 (the default) keeps to the stop-and-wait
+ * handshake of the Marklin bootloader. Any other value switches to a
+ * windowed variant of the protocol that Marklin devices don't speak,
+ * meant for devices of one's own that implement it as well.
+ */
+#ifndef RAILUINO_UPLOAD_WINDOW
+#define RAILUINO_UPLOAD_WINDOW 0
+#endif
+
+/**
+ * Number of times upload() retransmits a block before giving up.
+ */
+#ifndef RAILUINO_UPLOAD_RETRIES
+#define RAILUINO_UPLOAD_RETRIES 3
+#endif
+
+/**
+ * Number of operations a TrackBatch can hold.
+ */
+#ifndef RAILUINO_BATCH
+#if defined(__UNO__)
+#define RAILUINO_BATCH 6
+#else
+#define RAILUINO_BATCH 16
+#endif
+#endif
+
+/**
+ * Constants for the directions of a TrackRoute.
+ */
+#define ROUTE_A_TO_B 1
+#define ROUTE_B_TO_A 2
+#define ROUTE_BOTH 3
+
 /**
  * Represents a message going through the Marklin CAN bus. More or
  * less a beautified version of the real CAN message. You normally
@@ -159,6 +471,7 @@ public:
    * undefined afterwards, and a clear() is recommended.
    */
   boolean parseFrom(String &s);
+  boolean parseFrom(const char *s);
 
   /**
    * Parses the message from the CAN message data returned by
@@ -167,7 +480,42 @@ public:
   boolean fromCanMsg(unsigned long aId, byte aExt, byte aRtr, byte aLen, byte *aBuf);
 };
 
+/**
+ * A change of the layout state seen on the bus. The meaning of the
+ * fields depends on the CHANGE_* type:
+ *
+ * CHANGE_SPEED      address = locomotive, value = speed
+ * CHANGE_DIRECTION  address = locomotive, value = direction
+ * CHANGE_FUNCTION   address = locomotive, index = function, value = power
+ * CHANGE_ACCESSORY  address = accessory, index = power, value = position
+ * CHANGE_SENSOR     address = contact, index = device, value = state
+ * CHANGE_POWER      value = power
+ *
+ * The time is the millis() at which the change was seen.
+ */
+struct TrackChange
+{
+  byte type;
+  byte index;
+  word address;
+  word value;
+  unsigned long time;
+};
+
+/**
+ * The read position and filter of a subscriber to layout changes.
+ * See TrackController::subscribe().
+ */
+struct TrackSubscriber
+{
+  word sequence;
+  byte mask;
+  word lost;
+};
+
 class MCP_CAN;
+class TrackBus;
+class TrackBatch;
 
 class TrackController
 {
@@ -183,6 +531,80 @@ public:
    */
   void init(MCP_CAN &aCAN);
 
+  /**
+   * Initialises the TrackController with two MCP_CAN objects
+   * connected to the same bus, for instance two CAN-Bus Shields
+   * with different chip select pins. Messages are sent on the
+   * primary one while both are watched. When sending fails or the
+   * primary one stops receiving while the secondary one doesn't,
+   * the controller switches over, resending a request that is
+   * still waiting for its response.
+   */
+  void init(MCP_CAN &aPrimary, MCP_CAN &aSecondary);
+
+  /**
+   * Returns the number of switch-overs between the CAN interfaces.
+   */
+  word getFailovers();
+
+  /**
+   * Initialises the TrackController with a TrackBus that it shares
+   * with other controllers, each having its own hash and state.
+   * Returns false if RAILUINO_BUS_CONTROLLERS controllers already
+   * share the bus, in which case this one can't receive anything.
+   */
+  boolean init(TrackBus &aBus);
+
+  /**
+   * Processes pending incoming messages, up to RAILUINO_UPDATE_BUDGET,
+   * and runs the background tasks, such as the accessory sweep.
+   * Never blocks. Call this as often as possible from loop() when
+   * using any of them.
+   */
+  void update();
+
+#if RAILUINO_GATEWAY
+  /**
+   * Serves the bus to a host connected through the given stream,
+   * typically Serial, so that several tools on the host can share
+   * this controller instead of each needing its own. Every line
+   * read from the stream is parsed as a TrackMessage in the format
+   * of printTo() and sent as is, hash included, without waiting for
+   * the response, so a host may submit whole batches at once. Every
+   * message received is written back as a line. A line consisting
+   * of a single '?' dumps the known states as lines of the form
+   *
+   * L AAAA SSSS DD FFFFFFFF   (address, speed, direction, functions)
+   * A AAAA PP WW              (address, position, power)
+   *
+   * Messages are queued per hash, that is per tool on the host, and
+   * the queues take turns in proportion to their weights (deficit
+   * round-robin), so a chatty tool can't hold up the others. Stop
+   * and emergency stop commands skip all queues. A message that
+   * doesn't fit into its queue is answered with an error line.
+   *
+   * Never blocks. Call this instead of update() from loop(). Only
+   * available if RAILUINO_GATEWAY is enabled.
+   */
+  void serve(Stream &stream);
+
+  /**
+   * Sets the weight of the tool using the given hash in serve(),
+   * which defaults to 1. A tool with weight 2 gets twice the bus
+   * time of one with weight 1 while both have messages queued.
+   * Returns false if RAILUINO_CLIENTS tools are already known.
+   */
+  boolean setClientWeight(word hash, byte weight);
+
+  /**
+   * Returns the longest time (in ms) a message of the tool using
+   * the given hash has spent in its queue since the last call, then
+   * starts over. Also returns the number of messages dropped because
+   * the queue was full.
+   */
+  unsigned long getClientWait(word hash, word *dropped = nullptr);
+#endif
+
   /**
    * Sends a message and reports true on success. Internal method.
    * Normally you don't want to use this, but the more convenient
@@ -287,6 +709,16 @@ public:
    */
   boolean setAccessory(word address, byte position, byte power, word time);
 
+  /**
+   * Switches the given magnetic accessory like setAccessory(), but
+   * without waiting for any response. A non-zero time is handled in
+   * the background by update(), which switches the accessory off
+   * again once the time has passed, so a sketch using it must call
+   * update() often enough to keep the pulses short. Pulses that are
+   * over are also switched off by the next call with a non-zero
+   * time. If RAILUINO_PULSES accessories are still active, this
+   * falls back to waiting for the time.
+   */
   boolean setAccessory2(word address, byte position, byte power, word time);
 
   /**
@@ -320,6 +752,25 @@ public:
    */
   boolean getLocoFunction(word address, byte function, byte *power);
 
+  /**
+   * Queries all 32 functions of the given locomotive at once and
+   * writes them into the referenced bitmap, function 0 being the
+   * lowest bit. The queries are sent back to back instead of one
+   * after the other, so this takes about as long as a single call
+   * to getLocoFunction(). The return value indicates whether all
+   * functions were reported and the bitmap is valid.
+   */
+  boolean getLocoFunctions(word address, uint32_t *functions);
+
+  /**
+   * Sets all 32 functions of the given locomotive from the given
+   * bitmap, function 0 being the lowest bit. Only functions that
+   * differ from their last known state are sent, all of them back
+   * to back. The return value reflects whether all of them were
+   * confirmed.
+   */
+  boolean setLocoFunctions(word address, uint32_t functions);
+
   /**
    * Queries the given magnetic accessory's state and and writes
    * it into the referenced bytes. The return value indicates
@@ -362,10 +813,757 @@ public:
    */
   boolean getSystemStatus(uint32_t uid, byte channel, word *status);
 
+  /**
+   * Configures the circuit breaker for unresponsive targets. After
+   * 'threshold' consecutive timeouts a locomotive, accessory or
+   * device is considered unreachable, and all requests addressed to
+   * it fail immediately for 'backoff' ms. The first request after
+   * that window is let through as a probe. If it succeeds, the
+   * target is reachable again, otherwise it stays unreachable for
+   * another window. A threshold of 0 (the default) disables the
+   * circuit breaker. System-wide requests are never blocked.
+   */
+  void setCircuitBreaker(byte threshold, word backoff);
+
+  /**
+   * Queries whether the given target (a locomotive or accessory
+   * address, or a device uid) is currently considered reachable.
+   */
+  boolean isReachable(uint32_t target);
+
+  /**
+   * Enables or disables redundant-write elision. When enabled,
+   * setLocoSpeed(), setLocoDirection(), setLocoFunction() and
+   * setAccessory() without a switching time report success without
+   * sending anything if the target already has the requested value,
+   * as last confirmed by a response seen on the bus. A value that
+   * has not been confirmed for 'resync' ms is sent anyway, which
+   * guards against changes made by other devices that were missed.
+   * A resync interval of 0 trusts known values indefinitely. As
+   * setLocoDirection() also stops the locomotive, it is only elided
+   * for a locomotive known to stand still.
+   */
+  void setWriteElision(boolean enabled, unsigned long resync);
+
+  /**
+   * Enables or disables speed quantisation. When enabled,
+   * setLocoSpeed() reports success without sending anything if the
+   * new speed results in the same decoder speed step (see
+   * speedStep()) as the last known speed of the locomotive. This
+   * drops most of the traffic analog throttles cause. The resync
+   * interval of setWriteElision() applies as well.
+   */
+  void setSpeedQuantisation(boolean enabled);
+
+  /**
+   * Enables or disables cached reads. When enabled, getAccessory(),
+   * getTurnout(), getLocoSpeed(), getLocoDirection() and
+   * getLocoFunction() answer from the last known state of the
+   * accessory or locomotive, if there is one, instead of querying
+   * the bus. With a non-zero 'ttl', only states confirmed within
+   * the last 'ttl' ms are used, as other devices may have changed
+   * them unseen.
+   */
+  void setCachedReads(boolean enabled, unsigned long ttl = 0);
+
+  /**
+   * Configures background revalidation of the known states. Every
+   * 'interval' ms, update() refreshes the entry that most needs it:
+   * among those older than half the time to live of cached reads,
+   * the one read most often, or else the oldest one. This keeps
+   * cached reads both fast and trustworthy while costing no more
+   * than one or two frames per interval. Of a locomotive, only the
+   * speed and direction are refreshed; its function states simply
+   * expire and are read from the bus again when asked for. Requires
+   * cached reads with a non-zero time to live. An interval of 0
+   * disables it.
+   */
+  void setRevalidation(word interval);
+
+  /**
+   * Saves the known locomotive and accessory states to the EEPROM,
+   * starting at the given EEPROM address, together with a version
+   * and a checksum. Only bytes that differ from what is stored are
+   * written, so saving often wears the EEPROM as little as possible.
+   * Returns the number of bytes the saved states occupy.
+   */
+  int saveState(int base = 0);
+
+  /**
+   * Restores the locomotive and accessory states saved by
+   * saveState(), so that a restarted sketch doesn't start blind.
+   * Restored states count as about 12 days old, so with a shorter
+   * resync interval (see setWriteElision()) they get revalidated by
+   * the next write, and they are the first to make room for new
+   * ones. The return value reflects whether states with a matching
+   * version and checksum were found.
+   */
+  boolean restoreState(int base = 0);
+
+  /**
+   * Prints the metrics collected so far in the Prometheus text
+   * exposition format: frames sent and received, an estimate of the
+   * bits they occupied on the bus, exchanges, timeouts and matched
+   * responses per command, messages skipped while waiting for a
+   * response, and a histogram of response times. Prints nothing
+   * if RAILUINO_METRICS is disabled.
+   */
+  size_t printMetrics(Print &p);
+
+  /**
+   * Starts a background sweep over the magnetic accessories from
+   * 'first' to 'last' (inclusive). update() queries one of them
+   * every 'interval' ms while the bus is otherwise quiet, so that
+   * their states become known shortly after start-up without
+   * stalling other commands. Note that only RAILUINO_ACC_STATES
+   * accessories can be remembered.
+   */
+  void sweepAccessories(word first, word last, word interval);
+
+#if RAILUINO_RECENT_LOCOS
+  /**
+   * Prefetches the speed, direction and functions of the given
+   * locomotive, for instance when a throttle selects it. The queries
+   * are sent by update(), one per call and only while the receive
+   * buffers are drained, without waiting for the responses, which
+   * fill the known states as they arrive. Together with cached
+   * reads, getLocoSpeed() and friends then answer without touching
+   * the bus. Also prefetches as many of the locomotives selected
+   * before as configured with setPrefetchNeighbours(), unless their
+   * states are already known, as the operator is likely to switch
+   * back to them.
+   */
+  void prefetchLoco(word address);
+
+  /**
+   * Sets the number of recently selected locomotives that
+   * prefetchLoco() fetches along with the selected one. Defaults to
+   * 0, at most RAILUINO_RECENT_LOCOS - 1 make sense.
+   */
+  void setPrefetchNeighbours(byte count);
+#endif
+
+#if RAILUINO_REFLEXES
+  /**
+   * Adds a reflex rule: whenever the given contact of the given S88
+   * device changes in the way denoted by the EDGE_* constant, the
+   * given message is sent. This happens right inside the receive
+   * path, as soon as the contact event is read from the bus, and
+   * thus before anything else the sketch would send in reaction to
+   * it. Several rules may share a contact to send several messages.
+   * The message is copied, so it can be recycled afterwards. The
+   * return value reflects whether there was room for the rule.
+   */
+  boolean addReflex(word device, word contact, byte edge, TrackMessage &message);
+
+  /**
+   * Removes all reflex rules.
+   */
+  void clearReflexes();
+#endif
+
+#if RAILUINO_CHANGES
+  /**
+   * Subscribes to the layout changes denoted by the given mask of
+   * CHANGE_* constants. The subscriber will see all changes from
+   * now on. Any number of subscribers may read changes independently
+   * of each other and at their own pace.
+   */
+  void subscribe(TrackSubscriber &subscriber, byte mask);
+
+  /**
+   * Reads the next layout change the given subscriber hasn't seen
+   * yet, skipping those it isn't interested in. Changes that were
+   * dropped because the subscriber fell behind too far are counted
+   * in its 'lost' field. The return value reflects whether there
+   * was a change. Changes are only recorded while messages are
+   * received, so update() should be called regularly.
+   */
+  boolean nextChange(TrackSubscriber &subscriber, TrackChange *change);
+
+  /**
+   * Writes all layout changes the given subscriber hasn't seen yet
+   * to the given Print object, for instance a Serial connection to
+   * a throttle, as compact binary records of six bytes each:
+   *
+   * TT II AAAA VVVV   (type, index, address, value; see TrackChange)
+   *
+   * with words in big endian order. Returns the number of bytes
+   * written.
+   */
+  size_t pushChanges(Print &p, TrackSubscriber &subscriber);
+
+  /**
+   * Writes the known state of all locomotives and accessories, as
+   * far as the subscriber's mask selects it, as binary records in
+   * the format of pushChanges(). Meant for bringing a newly
+   * connected client up to date before pushing changes to it.
+   * Returns the number of bytes written.
+   */
+  size_t pushSnapshot(Print &p, TrackSubscriber &subscriber);
+#endif
+
+  /**
+   * Enables or disables the overload halt. When enabled, the track
+   * power is switched off right inside the receive path as soon as
+   * any device reports an overload or short circuit.
+   */
+  void setOverloadHalt(boolean enabled);
+
+  /**
+   * Sets a function to be called right inside the receive path
+   * whenever a device reports an overload on one of its channels.
+   * Pass nullptr to remove the handler. The handler must not block.
+   */
+  void setOverloadHandler(void (*handler)(uint32_t uid, byte channel));
+
+#if RAILUINO_OVERLOAD_DEVICES
+  /**
+   * Queries whether the device with the given uid (or any device for
+   * uid 0) has reported an overload since the last call to
+   * clearOverload(), and writes a bitmap of the affected channels
+   * (channel 0 being the lowest bit) into the referenced byte.
+   */
+  boolean getOverload(uint32_t uid, byte *channels);
+#endif
+
+  /**
+   * Returns the number of overload reports seen since start-up.
+   */
+  word getOverloadCount();
+
+#if RAILUINO_OVERLOAD_DEVICES
+  /**
+   * Forgets all reported overloads, typically after the cause has
+   * been removed and the power has been switched on again.
+   */
+  void clearOverload();
+#endif
+
+  /**
+   * Configures the link monitor. update() pings the device with the
+   * given uid (or any device for uid 0) every 'interval' ms. After
+   * 'misses' consecutive pings without a reply, the link is
+   * considered down, and all exchanges fail right after sending
+   * their request instead of timing out one by one, until a ping is
+   * answered again, so that requests such as stop commands still
+   * reach the bus. An interval of 0 (the default) disables the link
+   * monitor.
+   */
+  void setLinkMonitor(uint32_t uid, word interval, byte misses);
+
+  /**
+   * Sets a function to be called whenever the link monitor considers
+   * the link going down (false) or coming back up (true). Pass
+   * nullptr to remove the handler.
+   */
+  void setLinkHandler(void (*handler)(boolean up));
+
+  /**
+   * Queries whether the link monitor considers the link up. Always
+   * true if the link monitor is disabled.
+   */
+  boolean isLinkUp();
+
+  /**
+   * Returns the smoothed ping round trip time in microseconds.
+   */
+  unsigned long getLinkRtt();
+
+  /**
+   * Returns the number of pings that went unanswered since start-up.
+   */
+  word getLinkLoss();
+
+  /**
+   * Uploads 'size' bytes using command 0x1B for firmware or 0x21 for
+   * config data. The bytes are obtained from the given reader, which
+   * may fetch them from flash or an SD card. All CRCs are CRC-16
+   * (CCITT, initial value 0xFFFF).
+   *
+   * Config data goes out as a plain stream: a frame holding the size
+   * and the CRC of all bytes, then the bytes in 8-byte frames. The
+   * UID is not used, and nothing gets answered.
+   *
+   * Firmware goes to the device with the given UID in blocks of 64
+   * bytes, each consisting of
+   *
+   * - a frame UID, 0x44, block number selecting the block,
+   * - up to eight 8-byte data frames with hash 0x0300 + index,
+   * - a frame UID, 0x88, CRC of the block.
+   *
+   * The device answers the first frame as is, and the last one with
+   * the CRC it got, or with 0xF1 if something went wrong. Only the
+   * data frames of a block go out without waiting. A block that is
+   * not acknowledged within 'timeout' ms is sent again, up to
+   * RAILUINO_UPLOAD_RETRIES times.
+   *
+   * With a non-zero RAILUINO_UPLOAD_WINDOW, up to that many blocks
+   * are in flight at the same time instead. As this needs the block
+   * number in the acknowledgement, block numbers then take 16 bits,
+   * and the last frame is UID, 0x88, block number (low byte), CRC.
+   * The device asks for a block again by answering with the CRC it
+   * got or with UID, 0xF1, block number (low byte). Marklin devices
+   * don't speak this variant.
+   *
+   * The return value indicates whether the upload succeeded. Blocks
+   * until the upload is done.
+   */
+  boolean upload(byte command, uint32_t uid, uint32_t size, void (*reader)(uint32_t offset, byte *buffer, byte length), word timeout = 1000);
+
+  /**
+   * Returns the number of blocks retransmitted by upload() since
+   * start-up.
+   */
+  word getUploadRetransmits();
+
 private:
+  enum
+  {
+    LOCO_SPEED = 0x01,
+    LOCO_DIRECTION = 0x02
+  };
+
+  struct LocoState
+  {
+    word address;
+    word speed;
+    byte direction;
+    byte flags;
+    byte reads;
+    uint32_t functions;
+    uint32_t known;
+    unsigned long stamp;
+    unsigned long functionStamp;
+  };
+
+  struct AccessoryState
+  {
+    word address;
+    byte position;
+    byte power;
+    byte reads;
+    unsigned long stamp;
+  };
+
+  struct Pulse
+  {
+    Pulse *next;
+    word address;
+    byte position;
+    unsigned long due;
+  };
+
+#if RAILUINO_REFLEXES
+  struct Reflex
+  {
+    word device;
+    word contact;
+    byte edge;
+    byte command;
+    byte length;
+    byte data[8];
+  };
+#endif
+
+#if RAILUINO_OVERLOAD_DEVICES
+  struct Overload
+  {
+    uint32_t uid;
+    byte channels;
+    unsigned long time;
+  };
+#endif
+
+  LocoState *findLoco(word address, boolean create);
+  AccessoryState *findAccessory(word address, boolean create);
+  LocoState *findCachedLoco(word address, boolean functions);
+
+#if RAILUINO_GATEWAY
+  struct Queued
+  {
+    TrackMessage message;
+    unsigned long time;
+  };
+
+  struct Client
+  {
+    word hash;
+    byte weight;
+    word deficit;
+    unsigned long wait;
+    word dropped;
+    TrackRing<Queued, RAILUINO_CLIENT_QUEUE> queue;
+  };
+
+  Client *findClient(word hash, boolean create);
+  void transmit();
+  void dumpState(Print &p);
+#endif
+
+#if RAILUINO_UPLOAD_WINDOW
+  enum
+  {
+    BLOCK_FREE,
+    BLOCK_SENT,
+    BLOCK_RESEND
+  };
+
+  struct Upload
+  {
+    byte command;
+    uint32_t uid;
+    uint32_t size;
+    void (*reader)(uint32_t offset, byte *buffer, byte length);
+    word acked;
+    struct
+    {
+      word number;
+      word crc;
+      byte state;
+      byte tries;
+      unsigned long time;
+    } blocks[RAILUINO_UPLOAD_WINDOW];
+  };
+
+  void sendBlock(Upload &upload, byte index);
+  void receiveAcks(Upload &upload);
+#else
+  boolean uploadBlock(byte command, uint32_t uid, uint32_t size, void (*reader)(uint32_t offset, byte *buffer, byte length), byte number, word timeout);
+#endif
+#if RAILUINO_RECENT_LOCOS
+  boolean isKnownLoco(word address);
+  void prefetch();
+#endif
+  boolean isFresh(unsigned long stamp);
+  boolean exchangeFunctions(word address, uint32_t mask, uint32_t *functions, boolean set);
+  boolean pipeline(byte count, word timeout, void *context, boolean (*build)(void *context, byte index, TrackMessage &message), boolean (*match)(void *context, TrackMessage &message));
+  void observe(TrackMessage &message);
+  void countFrame(byte length, boolean sent);
+  void countResponse(byte command, unsigned long rtt);
+  void countSkipped();
+  void countTimeout(byte command);
+  void service(Print *echo);
+  void flushBus();
+  void releasePulses();
+  void revalidate();
+  void publish(byte type, word address, byte index, word value);
+
+  struct Breaker
+  {
+    uint32_t target;
+    byte failures;
+    unsigned long until;
+  };
+
+  Breaker *findBreaker(uint32_t target, boolean create);
+
+  void failover();
+
   MCP_CAN *mCAN = nullptr;
   word mHash = 0;
   boolean mDebug = false;
+
+  MCP_CAN *mStandby = nullptr;
+  boolean mStandbyOnly = false;
+  unsigned long mStandbyTime = 0;
+  word mFailovers = 0;
+
+  TrackBus *mBus = nullptr;
+
+  Breaker mBreakers[RAILUINO_BREAKER_TARGETS] = {};
+  byte mBreakerThreshold = 0;
+  word mBreakerBackoff = 0;
+
+  LocoState mLocos[RAILUINO_LOCO_STATES] = {};
+  AccessoryState mAccessories[RAILUINO_ACC_STATES] = {};
+  boolean mElision = false;
+  unsigned long mResync = 0;
+  boolean mQuantise = false;
+  boolean mCachedReads = false;
+  unsigned long mTtl = 0;
+  word mRevalidateInterval = 0;
+  unsigned long mRevalidateTime = 0;
+
+#if RAILUINO_CHANGES
+  TrackChange mChanges[RAILUINO_CHANGES] = {};
+  word mChangeSequence = 0;
+#endif
+
+#if RAILUINO_REFLEXES
+  Reflex mReflexes[RAILUINO_REFLEXES] = {};
+  byte mReflexCount = 0;
+#endif
+
+#if RAILUINO_OVERLOAD_DEVICES
+  Overload mOverloads[RAILUINO_OVERLOAD_DEVICES] = {};
+#endif
+  word mOverloadCount = 0;
+  boolean mOverloadHalt = false;
+  void (*mOverloadHandler)(uint32_t uid, byte channel) = nullptr;
+
+  uint32_t mLinkUid = 0;
+  word mLinkInterval = 0;
+  byte mLinkThreshold = 0;
+  byte mLinkMisses = 0;
+  boolean mLinkUp = true;
+  boolean mPingPending = false;
+  unsigned long mPingTime = 0;
+  unsigned long mPingSent = 0;
+  unsigned long mLinkRtt = 0;
+  word mLinkLoss = 0;
+  void (*mLinkHandler)(boolean up) = nullptr;
+
+#if RAILUINO_METRICS
+  struct Metrics
+  {
+    unsigned long sent;
+    unsigned long received;
+    unsigned long bits;
+    unsigned long skipped;
+    unsigned long matched;
+    word exchanges[RAILUINO_METRIC_COMMANDS + 1];
+    word timeouts[RAILUINO_METRIC_COMMANDS + 1];
+    unsigned long buckets[8];
+    unsigned long rttSum;
+  };
+
+  Metrics mMetrics = {};
+#endif
+
+  TrackPool<Pulse, RAILUINO_PULSES> mPulsePool;
+  TrackList<Pulse> mPulses;
+
+#if RAILUINO_GATEWAY
+  char mLine[RAILUINO_LINE] = {};
+  byte mLineLength = 0;
+
+  Client mClients[RAILUINO_CLIENTS] = {};
+  byte mClientCount = 0;
+  byte mClientTurn = 0;
+  boolean mClientCredited = false;
+  TrackRing<Queued, RAILUINO_CLIENT_QUEUE> mStops;
+#endif
+
+  word mUploadRetransmits = 0;
+
+  word mSweepNext = 0;
+  word mSweepLast = 0;
+  word mSweepInterval = 0;
+  unsigned long mSweepTime = 0;
+
+#if RAILUINO_RECENT_LOCOS
+  word mRecent[RAILUINO_RECENT_LOCOS] = {};
+  byte mNeighbours = 0;
+  TrackRing<word, RAILUINO_RECENT_LOCOS> mPrefetches;
+  word mPrefetchAddress = 0;
+  byte mPrefetchStep = 0;
+#endif
+
+  friend class TrackBus;
+  friend class TrackBatch;
+};
+
+/**
+ * Shares a single CAN-Bus Shield between several TrackControllers,
+ * for instance a throttle panel, a signal box and some automation
+ * in the same sketch. The bus reads each incoming message once and
+ * hands it to every attached controller, so none of them steals
+ * messages another one is waiting for.
+ */
+class TrackBus
+{
+public:
+  /**
+   * Initialises the TrackBus with the MCP_CAN object used for
+   * communication over the CAN-Bus Shield. Controllers are attached
+   * by calling their init() with the TrackBus afterwards.
+   */
+  void init(MCP_CAN &aCAN);
+
+  /**
+   * Reads pending incoming messages, up to RAILUINO_UPDATE_BUDGET,
+   * and hands them to the attached controllers. Never blocks.
+   * Controllers do this themselves whenever they receive, so
+   * calling it is only needed if none of them is being updated.
+   */
+  void update();
+
+private:
+  struct Slot
+  {
+    TrackController *controller;
+    TrackRing<TrackMessage, RAILUINO_BUS_INBOX> inbox;
+  };
+
+  boolean attach(TrackController &controller);
+  boolean receive(TrackController &controller, TrackMessage &message);
+  void flush(TrackController &controller);
+
+  MCP_CAN *mCAN = nullptr;
+  Slot mSlots[RAILUINO_BUS_CONTROLLERS] = {};
+  byte mCount = 0;
+
+  friend class TrackController;
+};
+
+/**
+ * An entry of the routing table of a TrackBridge. Requests with the
+ * given command whose address lies between 'first' and 'last'
+ * (inclusive) are forwarded in the given ROUTE_* directions. Use
+ * 0 to 0xFFFF for commands that don't carry an address.
+ */
+struct TrackRoute
+{
+  byte command;
+  word first;
+  word last;
+  byte directions;
+};
+
+/**
+ * Connects two CAN bus segments, for instance through two CAN-Bus
+ * Shields, so that each segment only carries the traffic it needs.
+ * Requests are forwarded according to a routing table, responses
+ * are routed back to the segment the request came from, and
+ * everything else stays local to its segment.
+ */
+class TrackBridge
+{
+public:
+  /**
+   * Initialises the TrackBridge with the MCP_CAN objects of the two
+   * segments and a routing table of 'count' entries, which is
+   * referenced, not copied, and thus best declared as a constant.
+   */
+  void init(MCP_CAN &aSegmentA, MCP_CAN &aSegmentB, const TrackRoute *routes, byte count);
+
+  /**
+   * Forwards pending incoming messages of both segments, up to
+   * RAILUINO_UPDATE_BUDGET per segment. Never blocks. Call this as
+   * often as possible from loop().
+   */
+  void update();
+
+  /**
+   * Returns the number of messages forwarded and filtered so far.
+   */
+  unsigned long getForwarded();
+  unsigned long getFiltered();
+
+private:
+  struct Pending
+  {
+    word hash;
+    word address;
+    byte command;
+    byte from;
+    unsigned long time;
+  };
+
+  void forward(byte from, TrackMessage &message);
+
+  MCP_CAN *mSegments[2] = {};
+  const TrackRoute *mRoutes = nullptr;
+  byte mRouteCount = 0;
+  Pending mPending[RAILUINO_BRIDGE_PENDING] = {};
+  unsigned long mForwarded = 0;
+  unsigned long mFiltered = 0;
+};
+
+/**
+ * A batch of operations on locomotives and accessories, for instance
+ * all changes that set up a scene. The operations are queued first,
+ * then submitted as one burst of back-to-back messages, so the batch
+ * takes about as much bus time as its frames, and their responses
+ * are collected as they arrive. Afterwards, the result of each
+ * operation, the overall success and the total latency can be
+ * queried. Optionally, a batch that didn't fully succeed is rolled
+ * back, restoring the previous states of those locomotives and
+ * accessories that did change, as far as the controller knew them.
+ */
+class TrackBatch
+{
+public:
+  /**
+   * Queue an operation like the TrackController function of the
+   * same name. The return value indicates whether there was room
+   * for the operation.
+   */
+  boolean setLocoSpeed(word address, word speed);
+  boolean setLocoDirection(word address, byte direction);
+  boolean setLocoFunction(word address, byte function, byte power);
+  boolean setAccessory(word address, byte position, byte power);
+
+  /**
+   * Submits all queued operations through the given controller and
+   * waits until all of them are confirmed, or until no response has
+   * arrived for 'timeout' ms. If 'rollback' is true and any
+   * operation failed, the confirmed ones are undone in reverse
+   * order, without waiting. The return value indicates whether all
+   * operations were confirmed.
+   */
+  boolean submit(TrackController &controller, word timeout = 1000, boolean rollback = false);
+
+  /**
+   * Returns the number of queued operations.
+   */
+  byte size();
+
+  /**
+   * Returns whether the operation with the given index, in the order
+   * of queueing, was confirmed by the last submit().
+   */
+  boolean getResult(byte index);
+
+  /**
+   * Returns the number of operations that failed in the last
+   * submit(), and the number of those undone by its rollback.
+   */
+  byte getFailures();
+  byte getRolledBack();
+
+  /**
+   * Returns the time (in us) the last submit() took from sending the
+   * first message to receiving the last response or giving up.
+   */
+  unsigned long getLatency();
+
+  /**
+   * Removes all operations so the batch can be reused.
+   */
+  void clear();
+
+private:
+  enum
+  {
+    OP_DONE = 1,
+    OP_UNDO = 2,
+    OP_SENT = 4,
+    OP_BLOCKED = 8
+  };
+
+  struct Operation
+  {
+    byte command;
+    byte length;
+    word address;
+    byte data[2];
+    byte undo[2];
+    byte flags;
+  };
+
+  boolean add(byte command, byte length, word address, byte data0, byte data1);
+  void prepare(TrackController &controller, Operation *operation);
+  void toMessage(Operation *operation, const byte *data, TrackMessage &message);
+  static boolean build(void *context, byte index, TrackMessage &message);
+  static boolean match(void *context, TrackMessage &message);
+
+  Operation mOperations[RAILUINO_BATCH] = {};
+  byte mCount = 0;
+  byte mFailures = 0;
+  byte mRolledBack = 0;
+  unsigned long mLatency = 0;
 };
 
 #endif